@@ -0,0 +1,128 @@
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include "mpt.hpp"
+
+
+// builds `num_rules` rules of the form `kw<i>_ $value ;` and times parsing statements that hit rules spread across
+// the whole list, so every statement has to walk a large part of the rule set before it finds its match
+double bench_rules(const size_t num_rules, const size_t num_statements, const size_t rule_threads) {
+    mgm::System mp{};
+    if (rule_threads > 1) {
+        mp.set_executor(std::make_shared<mgm::System::ThreadPool>(rule_threads - 1));
+        mp.parallel_rules = true;
+    }
+    for (size_t i = 0; i < num_rules; i++) {
+        const auto kw = "kw" + std::to_string(i) + "_";
+        mp.rules.emplace_back("   " + kw, "  $value", "   ;", "  +\"" + kw + " = $value;\"");
+    }
+
+    std::string input{};
+    for (size_t i = 0; i < num_statements; i++)
+        input += "kw" + std::to_string((i * 7919) % num_rules) + "_ v" + std::to_string(i) + " ;\n";
+
+    // compile outside of the timed region
+    mp.compile();
+
+    const auto begin = std::chrono::steady_clock::now();
+    const auto res = mp.parse(input);
+    const auto end = std::chrono::steady_clock::now();
+    if (res.is_error()) {
+        std::cerr << "Error at " << res.error()[0].pos.line << ':' << res.error()[0].pos.column << "\n\t"
+                  << res.error()[0].message << std::endl;
+        return 0.0;
+    }
+    return std::chrono::duration<double, std::micro>(end - begin).count() / double(num_statements);
+}
+
+// times loading `num_rules` rules of the same form from the rule-file format, and compiling them
+double bench_load(const size_t num_rules) {
+    std::string text{};
+    for (size_t i = 0; i < num_rules; i++) {
+        const auto kw = "kw" + std::to_string(i) + "_";
+        text += "   " + kw + "\n  $value\n   ;\n  +\"" + kw + " = $value;\"\n\n";
+    }
+
+    mgm::System mp{};
+    const auto begin = std::chrono::steady_clock::now();
+    const auto res = mp.load_rules(text);
+    mp.compile();
+    const auto end = std::chrono::steady_clock::now();
+    if (res.is_error()) {
+        std::cerr << "Error at line " << res.error()[0].pos.line << "\n\t" << res.error()[0].message << std::endl;
+        return 0.0;
+    }
+    return std::chrono::duration<double, std::milli>(end - begin).count();
+}
+
+// times loading the same rules from a grammar image in memory, which is what mapping an image file costs after the
+// mapping itself
+double bench_image(const size_t num_rules) {
+    mgm::System mp{};
+    for (size_t i = 0; i < num_rules; i++) {
+        const auto kw = "kw" + std::to_string(i) + "_";
+        mp.rules.emplace_back("   " + kw, "  $value", "   ;", "  +\"" + kw + " = $value;\"");
+    }
+    const auto image = mp.compile().to_image();
+    // images are loaded from 8 byte aligned memory, like a mapping
+    const auto buffer = std::make_shared<std::vector<uint64_t>>((image.size() + 7) / 8);
+    std::memcpy(buffer->data(), image.data(), image.size());
+
+    const auto begin = std::chrono::steady_clock::now();
+    const auto res = mgm::System::Grammar::from_image(reinterpret_cast<const char*>(buffer->data()), image.size(), buffer);
+    const auto end = std::chrono::steady_clock::now();
+    if (res.is_error()) {
+        std::cerr << res.error().message << std::endl;
+        return 0.0;
+    }
+    return std::chrono::duration<double, std::milli>(end - begin).count();
+}
+
+// times one small edit in the middle of a document of `num_statements` statements, parsed incrementally, against
+// parsing the whole document again
+std::pair<double, double> bench_edit(const size_t num_statements) {
+    mgm::System mp{};
+    for (size_t i = 0; i < 100; i++) {
+        const auto kw = "kw" + std::to_string(i) + "_";
+        mp.rules.emplace_back("   " + kw, "  $value", "   ;", "  +\"" + kw + " = $value;\"");
+    }
+    std::string input{};
+    for (size_t i = 0; i < num_statements; i++) input += "kw" + std::to_string(i % 100) + "_ v" + std::to_string(i) + " ;\n";
+
+    mgm::System::IncrementalParse doc{mp, input};
+    const size_t at = input.find('\n', input.size() / 2) + 1;
+    const auto begin = std::chrono::steady_clock::now();
+    doc.edit(at, at, "kw7_ inserted ;\n");
+    const auto edited = std::chrono::steady_clock::now();
+    const auto res = mp.parse(std::string{doc.text()});
+    const auto end = std::chrono::steady_clock::now();
+    if (res.is_error() || res.result() != doc.output()) {
+        std::cerr << "Incremental output differs from a full parse" << std::endl;
+        return {};
+    }
+    return {std::chrono::duration<double, std::milli>(edited - begin).count(),
+            std::chrono::duration<double, std::milli>(end - edited).count()};
+}
+
+int main(int argc, char** argv) {
+    const size_t num_statements = argc > 1 ? std::stoul(argv[1]) : 200;
+    const size_t rule_threads = argc > 2 ? std::stoul(argv[2]) : 1;
+
+    for (const size_t num_rules : {100, 1000, 4000}) {
+        const auto us = bench_rules(num_rules, num_statements, rule_threads);
+        std::cout << num_rules << " rules: " << us << " us/statement" << std::endl;
+    }
+    for (const size_t num_rules : {1000, 10000}) {
+        const auto ms = bench_load(num_rules);
+        const auto image_ms = bench_image(num_rules);
+        std::cout << "loading " << num_rules << " rules: " << ms << " ms, from an image: " << image_ms << " ms" << std::endl;
+    }
+    for (const size_t statements : {num_statements * 10, num_statements * 100}) {
+        const auto [edit_ms, full_ms] = bench_edit(statements);
+        std::cout << "edit in " << statements << " statements: " << edit_ms << " ms, parsing all of it: " << full_ms << " ms"
+                  << std::endl;
+    }
+    return 0;
+}
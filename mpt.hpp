@@ -1,34 +1,172 @@
 #pragma once
 #include <cstddef>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
 #include <functional>
+#include <initializer_list>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 
 namespace mgm {
+    // vector that keeps up to N elements inline and only allocates once it grows past that
+    template<typename T, size_t N>
+    class SmallVector {
+        alignas(T) unsigned char storage[N * sizeof(T)]{};
+        T* elements = reinterpret_cast<T*>(storage);
+        size_t count = 0;
+        size_t cap = N;
+
+        bool is_inline() const { return elements == reinterpret_cast<const T*>(storage); }
+
+        void grow(const size_t new_cap) {
+            T* new_elements = static_cast<T*>(::operator new(new_cap * sizeof(T)));
+            for (size_t i = 0; i < count; i++) {
+                new (new_elements + i) T{std::move(elements[i])};
+                elements[i].~T();
+            }
+            if (!is_inline())
+                ::operator delete(elements);
+            elements = new_elements;
+            cap = new_cap;
+        }
+
+      public:
+        SmallVector() = default;
+        SmallVector(std::initializer_list<T> list) {
+            reserve(list.size());
+            for (const auto& value : list) emplace_back(value);
+        }
+        SmallVector(const SmallVector& other) {
+            reserve(other.count);
+            for (const auto& value : other) emplace_back(value);
+        }
+        SmallVector(SmallVector&& other) {
+            if (other.is_inline()) {
+                for (auto& value : other) emplace_back(std::move(value));
+                other.clear();
+                return;
+            }
+            elements = other.elements;
+            count = other.count;
+            cap = other.cap;
+            other.elements = reinterpret_cast<T*>(other.storage);
+            other.count = 0;
+            other.cap = N;
+        }
+        SmallVector& operator=(const SmallVector& other) {
+            if (this == &other)
+                return *this;
+            clear();
+            reserve(other.count);
+            for (const auto& value : other) emplace_back(value);
+            return *this;
+        }
+        SmallVector& operator=(SmallVector&& other) {
+            if (this == &other)
+                return *this;
+            this->~SmallVector();
+            new (this) SmallVector{std::move(other)};
+            return *this;
+        }
+
+        template<typename... Ts>
+        T& emplace_back(Ts&&... args) {
+            if (count == cap)
+                grow(cap * 2);
+            return *new (elements + count++) T{std::forward<Ts>(args)...};
+        }
+        void push_back(const T& value) { emplace_back(value); }
+        void push_back(T&& value) { emplace_back(std::move(value)); }
+        void pop_back() { elements[--count].~T(); }
+
+        void reserve(const size_t new_cap) {
+            if (new_cap > cap)
+                grow(new_cap);
+        }
+        void clear() {
+            for (size_t i = 0; i < count; i++) elements[i].~T();
+            count = 0;
+        }
+
+        size_t size() const { return count; }
+        size_t capacity() const { return cap; }
+        bool empty() const { return count == 0; }
+
+        T* data() { return elements; }
+        const T* data() const { return elements; }
+        T& operator[](size_t i) { return elements[i]; }
+        const T& operator[](size_t i) const { return elements[i]; }
+        T& front() { return elements[0]; }
+        const T& front() const { return elements[0]; }
+        T& back() { return elements[count - 1]; }
+        const T& back() const { return elements[count - 1]; }
+
+        T* begin() { return elements; }
+        const T* begin() const { return elements; }
+        T* end() { return elements + count; }
+        const T* end() const { return elements + count; }
+
+        ~SmallVector() {
+            clear();
+            if (!is_inline())
+                ::operator delete(elements);
+        }
+    };
+
     class System {
       public:
+        // type used for positions in the source, word ids and offsets into compiled rules
+        // define MPT_COMPACT_INDEX to halve their size when inputs are known to stay under 4 GiB
+#ifdef MPT_COMPACT_INDEX
+        using Index = uint32_t;
+#else
+        using Index = size_t;
+#endif
+
+        struct GenericValue;
+
         struct Source {
             struct SourceData {
+                // a piece of a source made of several buffers, `begin` is its position in the whole source
+                // `index` is its position in the list the source was made from (empty pieces are left out)
+                struct Segment {
+                    const char* data = nullptr;
+                    size_t begin = 0, size = 0;
+                    size_t index = 0;
+                };
+
+                // copies share `buffer`, the first write through a shared copy makes it unique (copy on write)
+                std::shared_ptr<char[]> buffer{};
                 char* data = nullptr;
-                const SourceData* parent = nullptr;
-                std::vector<SourceData*> refs{};
                 size_t size = 0;
+                // set for sources made of several buffers, which are read in place instead of through `data`
+                std::shared_ptr<const std::vector<Segment>> segments{};
+                // only a hint, so threads reading the same source (see `parallel_rules`) don't need to agree on it
+                mutable std::atomic<size_t> last_segment{0};
 
                 SourceData() = default;
-
                 SourceData(const SourceData& other)
-                    : data{other.data}, size{other.size}, parent{other.parent ? other.parent : &other} {
-                    if (parent)
-                        const_cast<SourceData*>(parent)->refs.emplace_back(this);
-                }
-                SourceData(SourceData&& other) : data{other.data}, size{other.size}, parent{other.parent} {
+                    : buffer{other.buffer}, data{other.data}, size{other.size}, segments{other.segments},
+                      last_segment{other.last_segment.load(std::memory_order_relaxed)} {}
+                SourceData(SourceData&& other)
+                    : buffer{std::move(other.buffer)}, data{other.data}, size{other.size}, segments{std::move(other.segments)},
+                      last_segment{other.last_segment.load(std::memory_order_relaxed)} {
                     other.data = nullptr;
-                    other.parent = nullptr;
-                    other.refs.clear();
                     other.size = 0;
                 }
                 SourceData& operator=(const SourceData& other) {
@@ -46,57 +184,143 @@ namespace mgm {
                     return *this;
                 }
 
-                SourceData(const char* const& data_to_copy, const size_t size) : data{new char[size + 1]}, size{size + 1} {
-                    memcpy(this->data, data_to_copy, this->size);
+                SourceData(const char* const& data_to_copy, const size_t size)
+                    : buffer{new char[size + 1]}, data{buffer.get()}, size{size + 1} {
+                    memcpy(this->data, data_to_copy, size);
+                    this->data[size] = '\0';
+                }
+                // takes over the string instead of copying it
+                SourceData(std::string&& str) {
+                    const auto owner = std::make_shared<std::string>(std::move(str));
+                    owner->push_back('\0');
+                    buffer = std::shared_ptr<char[]>{owner, owner->data()};
+                    data = owner->data();
+                    size = owner->size() + 1;
+                }
+                // reads the pieces in place, they are not copied and have to outlive the source
+                SourceData(const std::vector<std::string_view>& pieces) {
+                    auto table = std::make_shared<std::vector<Segment>>();
+                    size_t total = 0;
+                    for (size_t i = 0; i < pieces.size(); i++) {
+                        if (pieces[i].empty())
+                            continue;
+                        table->emplace_back(Segment{pieces[i].data(), total, pieces[i].size(), i});
+                        total += pieces[i].size();
+                    }
+                    // same layout as a copied string, which ends with two terminators
+                    size = total + 2;
+                    segments = std::move(table);
+                }
+
+                bool is_segmented() const { return segments != nullptr; }
+
+                // index into `segments` of the piece holding position `i`, the last one if `i` is past the end
+                size_t find_segment(const size_t i) const {
+                    const auto& table = *segments;
+                    const auto it = std::upper_bound(table.begin(), table.end(), i, [](const size_t i, const Segment& segment) {
+                        return i < segment.begin;
+                    });
+                    return it == table.begin() ? 0 : static_cast<size_t>(it - table.begin()) - 1;
                 }
 
                 char& operator[](size_t i) {
-                    if (parent)
-                        make_unique();
+                    make_unique();
                     return data[i];
                 }
-                const char& operator[](size_t i) const { return data[i]; }
+                const char& operator[](size_t i) const {
+                    if (!segments)
+                        return data[i];
+                    static const char terminator = '\0';
+                    if (i >= size - 2)
+                        return terminator;
+                    const auto& table = *segments;
+                    size_t segment = last_segment.load(std::memory_order_relaxed);
+                    if (i < table[segment].begin || i >= table[segment].begin + table[segment].size) {
+                        segment = find_segment(i);
+                        last_segment.store(segment, std::memory_order_relaxed);
+                    }
+                    return table[segment].data[i - table[segment].begin];
+                }
 
                 bool operator==(const SourceData& other) const {
                     if (size != other.size)
                         return false;
                     for (size_t i = 0; i < size; i++)
-                        if (data[i] != other.data[i])
+                        if ((*this)[i] != other[i])
                             return false;
                     return true;
                 }
                 bool operator!=(const SourceData& other) const { return !(*this == other); }
 
+                // whether other sources (or parse output) still reference this data
+                bool is_shared() const { return buffer.use_count() > 1; }
+
+                // a segmented source is gathered into one buffer the first time it is written to
                 void make_unique() {
-                    if (parent == nullptr)
+                    if (segments) {
+                        std::shared_ptr<char[]> new_buffer{new char[size]};
+                        copy(new_buffer.get(), 0, size - 2);
+                        new_buffer[size - 2] = new_buffer[size - 1] = '\0';
+                        buffer = std::move(new_buffer);
+                        data = buffer.get();
+                        segments.reset();
+                        return;
+                    }
+                    if (!is_shared())
                         return;
-                    char* new_data = new char[size];
-                    memcpy(new_data, data, size);
-                    data = new_data;
-                    const_cast<SourceData*>(parent)->refs.erase(std::find(parent->refs.begin(), parent->refs.end(), this));
-                    parent = nullptr;
+                    std::shared_ptr<char[]> new_buffer{new char[size]};
+                    memcpy(new_buffer.get(), data, size);
+                    buffer = std::move(new_buffer);
+                    data = buffer.get();
                 }
 
-                SourceData sub_source(const size_t pos) const { return SourceData{data + pos, size - pos}; }
+                // copies `len` characters starting at `pos` to `out`
+                void copy(char* out, size_t pos, size_t len) const {
+                    if (!segments) {
+                        memcpy(out, data + pos, len);
+                        return;
+                    }
+                    const auto& table = *segments;
+                    for (size_t segment = find_segment(pos); len > 0 && segment < table.size(); segment++) {
+                        const size_t offset = pos - table[segment].begin;
+                        const size_t count = std::min(len, table[segment].size - offset);
+                        memcpy(out, table[segment].data + offset, count);
+                        out += count;
+                        pos += count;
+                        len -= count;
+                    }
+                }
+                // pointer to characters [pos, pos + len) if they are stored next to each other, otherwise nullptr
+                const char* contiguous(const size_t pos, const size_t len) const {
+                    if (!segments)
+                        return data + pos;
+                    const auto& segment = (*segments)[find_segment(pos)];
+                    if (pos < segment.begin || pos + len > segment.begin + segment.size)
+                        return nullptr;
+                    return segment.data + (pos - segment.begin);
+                }
 
-                std::string substr(const size_t pos, const size_t len) const { return std::string{data + pos, len}; }
+                SourceData sub_source(const size_t pos) const {
+                    if (!segments)
+                        return SourceData{data + pos, size - pos};
+                    std::string res(size - pos, '\0');
+                    copy(res.data(), pos, size - 2 - pos);
+                    return SourceData{res.c_str(), size - pos};
+                }
 
-                ~SourceData() {
-                    if (parent)
-                        const_cast<SourceData*>(parent)->refs.erase(std::find(parent->refs.begin(), parent->refs.end(), this));
-                    else if (!refs.empty())
-                        for (auto& ref : refs) ref->make_unique();
-                    else {
-                        delete[] data;
-                        new (this) SourceData{};
-                    }
+                std::string substr(const size_t pos, const size_t len) const {
+                    if (!segments)
+                        return std::string{data + pos, len};
+                    std::string res(len, '\0');
+                    copy(res.data(), pos, len);
+                    return res;
                 }
             };
 
             struct SourcePos {
-                size_t pos, line, column;
+                Index pos, line, column;
 
-                SourcePos(size_t pos = 0, size_t line = 1, size_t column = 1) : pos{pos}, line{line}, column{column} {};
+                SourcePos(Index pos = 0, Index line = 1, Index column = 1) : pos{pos}, line{line}, column{column} {};
 
                 bool operator==(const SourcePos& other) const {
                     return pos == other.pos && line == other.line && column == other.column;
@@ -106,10 +330,12 @@ namespace mgm {
 
             SourceData source{};
             SourcePos pos{};
+            // characters from `limit` on read as the end of the source, see `region`
+            size_t limit = std::numeric_limits<size_t>::max();
 
             Source() = default;
-            Source(const Source& other) : source{other.source}, pos{other.pos} {}
-            Source(Source&& other) : source{std::move(other.source)}, pos{other.pos} {}
+            Source(const Source& other) : source{other.source}, pos{other.pos}, limit{other.limit} {}
+            Source(Source&& other) : source{std::move(other.source)}, pos{other.pos}, limit{other.limit} {}
             Source& operator=(const Source& other) {
                 if (this == &other)
                     return *this;
@@ -127,12 +353,65 @@ namespace mgm {
 
             Source(const std::string& source, const SourcePos& pos = SourcePos{})
                 : source{source.c_str(), source.size() + 1}, pos{pos} {}
+            Source(std::string&& source, const SourcePos& pos = SourcePos{}) : source{std::move(source)}, pos{pos} {}
+            // a source made of several buffers, which are read in place (not copied) and have to outlive the source
+            // errors found in it are reported per buffer, see `CompilationError::segment`
+            Source(const std::vector<std::string_view>& segments, const SourcePos& pos = SourcePos{})
+                : source{segments}, pos{pos} {}
+            // the text a generic value was captured from (in place, with its position in the original input) if it is
+            // known, otherwise a copy of the value
+            Source(const GenericValue& value);
+
+            // view of characters [begin, end) of this source, sharing its data
+            // positions stay those of the whole source, so errors found in the view point into the original input
+            // line and column are found by walking from `pos` (or from the start of the source, if that's closer), so
+            // many regions of one input are cheapest to make from a source that is moved along with them
+            Source region(const size_t begin, const size_t end) const {
+                Source res = *this;
+                if (begin < res.pos.pos) {
+                    if (begin < res.pos.pos - begin)
+                        res.pos = SourcePos{};
+                    else {
+                        // lines are counted back to `begin`, and the column from the start of its line
+                        for (size_t i = res.pos.pos; i > begin; i--)
+                            if (std::as_const(source)[i - 1] == '\n')
+                                --res.pos.line;
+                        size_t line_begin = begin;
+                        while (line_begin > 0 && std::as_const(source)[line_begin - 1] != '\n') --line_begin;
+                        res.pos.pos = static_cast<Index>(begin);
+                        res.pos.column = static_cast<Index>(begin - line_begin + 1);
+                    }
+                }
+                res += begin - res.pos.pos;
+                res.limit = std::min(limit, end);
+                return res;
+            }
+
+            // position `pos` relative to the segment holding it, the segment's index is returned through `segment`
+            SourcePos locate(const size_t pos, size_t& segment) const {
+                segment = 0;
+                if (!source.is_segmented() || source.segments->empty())
+                    return SourcePos{static_cast<Index>(pos)};
+                const auto& piece = (*source.segments)[source.find_segment(pos)];
+                segment = piece.index;
+                SourcePos res{};
+                for (size_t i = piece.begin; i < pos && i < piece.begin + piece.size; i++) {
+                    if (piece.data[i - piece.begin] == '\n') {
+                        ++res.line;
+                        res.column = 1;
+                    }
+                    else
+                        ++res.column;
+                    ++res.pos;
+                }
+                return res;
+            }
 
             Source& operator++() {
                 if (reached_end())
                     return *this;
 
-                if (source[pos.pos] == '\n') {
+                if (std::as_const(source)[pos.pos] == '\n') {
                     ++pos.line;
                     pos.column = 1;
                 }
@@ -161,7 +440,7 @@ namespace mgm {
                 return res;
             }
 
-            size_t size() const { return source.size - 1; }
+            size_t size() const { return limit < source.size - 1 ? limit + 1 : source.size - 1; }
             bool empty() const { return source.size == 0; }
             bool reached_end() const { return pos.pos >= size() - 1; }
 
@@ -169,20 +448,24 @@ namespace mgm {
             const char& operator*() const { return (*this)[pos.pos]; }
 
             char& operator[](size_t i) { return source[i]; }
-            const char& operator[](size_t i) const { return source[i]; }
+            const char& operator[](size_t i) const {
+                static const char terminator = '\0';
+                return i < limit ? source[i] : terminator;
+            }
 
             bool operator==(const Source& other) const {
-                if (pos != other.pos)
+                if (pos != other.pos || limit != other.limit)
                     return false;
                 return source == other.source;
             }
             bool operator!=(const Source& other) const { return !(*this == other); }
 
-            bool matches(const std::string& str) const {
-                if (str.size() > size() - pos.pos)
+            bool matches(const std::string& str) const { return matches(str.data(), str.size(), pos.pos); }
+            bool matches(const char* str, const size_t len, const size_t at) const {
+                if (len > size() - at)
                     return false;
-                for (size_t i = 0; i < str.size(); i++)
-                    if (source[pos.pos + i] != str[i])
+                for (size_t i = 0; i < len; i++)
+                    if (source[at + i] != str[i])
                         return false;
                 return true;
             }
@@ -194,6 +477,8 @@ namespace mgm {
         struct CompilationError {
             enum class Severity { MESSAGE, WARNING, ERROR, SYSTEM_ERROR } severity{};
             Source::SourcePos pos{};
+            // for sources made of several buffers: the buffer the error is in, `pos` is relative to it
+            Index segment{};
             size_t code{};
             std::string message{};
             std::string fix{};
@@ -312,7 +597,20 @@ namespace mgm {
             }
         };
 
-        using GenericValueMap = std::unordered_map<std::string, std::vector<std::string>>;
+        // a value captured by a generic word, which also remembers where in the source it was captured from, so it can
+        // be parsed again in place (see `Source::region`)
+        struct GenericValue : std::string {
+            Source origin{};
+            size_t begin = 0, end = 0;
+
+            GenericValue() = default;
+            GenericValue(std::string value) : std::string{std::move(value)} {}
+            GenericValue(std::string value, const Source& origin, const size_t begin, const size_t end)
+                : std::string{std::move(value)}, origin{origin}, begin{begin}, end{end} {}
+
+            bool has_origin() const { return !origin.empty(); }
+        };
+        using GenericValueMap = std::unordered_map<std::string, std::vector<GenericValue>>;
 
       private:
         static bool is_whitespace(const char c) { return c == ' ' || c == '\n' || c == '\t'; }
@@ -442,11 +740,63 @@ namespace mgm {
         }
 
       public:
+        // finds where top-level statements end with a brace and quote scan, without matching any rules:
+        // a statement ends after a `;` or after the `}` that closes its outermost brace, outside of quotes
+        // the scan can be fed in pieces, its state carries over between calls
+        struct StatementScanner {
+            size_t depth = 0;
+            bool in_quote = false;
+            bool escaped = false;
+
+            // returns the position right after the last statement end in data[from, size), or 0 if there is none
+            size_t scan(const char* data, const size_t from, const size_t size) {
+                size_t last_end = 0;
+                for (size_t i = from; i < size; i++) {
+                    const char c = data[i];
+                    if (in_quote) {
+                        if (c == '"' && !escaped)
+                            in_quote = false;
+                        escaped = c == '\\';
+                        continue;
+                    }
+                    switch (c) {
+                        case '"':
+                            in_quote = true;
+                            escaped = false;
+                            break;
+                        case '(':
+                        case '[':
+                        case '{':
+                            ++depth;
+                            break;
+                        case ')':
+                        case ']':
+                            if (depth > 0)
+                                --depth;
+                            break;
+                        case '}':
+                            if (depth > 0)
+                                --depth;
+                            if (depth == 0)
+                                last_end = i + 1;
+                            break;
+                        case ';':
+                            if (depth == 0)
+                                last_end = i + 1;
+                            break;
+                        default:
+                            break;
+                    }
+                }
+                return last_end;
+            }
+        };
+
         struct Rule {
             struct Word {
-                enum class Type { DIRECT, GENERIC, EXPAND, ERROR_MESSAGE_SET, ERROR_FIX_SET };
-                enum class OptionalType { MANDATORY, OPTIONAL, OPTIONAL_LIST_MANDATORY_ONE };
-                enum class RepeatType { ONCE, REPEAT, REPEAT_SINGLE };
+                enum class Type : uint8_t { DIRECT, GENERIC, EXPAND, ERROR_MESSAGE_SET, ERROR_FIX_SET };
+                enum class OptionalType : uint8_t { MANDATORY, OPTIONAL, OPTIONAL_LIST_MANDATORY_ONE };
+                enum class RepeatType : uint8_t { ONCE, REPEAT, REPEAT_SINGLE };
                 std::string word{};
 
                 bool empty() const { return word.empty(); }
@@ -612,54 +962,360 @@ namespace mgm {
             }
 
             struct WordMatch {
-                size_t id{};
-                std::pair<size_t, size_t> match{};
+                Index id{};
+                std::pair<Index, Index> match{};
+            };
+            // most rules are short enough for their matches to never leave the stack
+            using WordMatches = SmallVector<WordMatch, 16>;
+
+            // compiles a grammar of just this rule on every call, which allocates, so it's only meant for trying out a
+            // single rule, anything matching many times should use the grammar from `System::compile` (see
+            // `Grammar::match`), which is only built again when the rules change
+            Result<WordMatches, std::pair<WordMatches, CompilationError>> match(const Source& str) const {
+                Grammar grammar{};
+                grammar.add(*this);
+                return grammar.match(0, str);
+            }
+        };
+
+        // Rules compiled into flat arrays: one entry per word in `kinds` and `flags`, word text pooled in `literals`,
+        // and `rule_offsets[i]` is the index of the first word of rule i. Matching walks these tables instead of the
+        // per-word strings held by `Rule`.
+        struct Grammar {
+            using Word = Rule::Word;
+            using WordMatch = Rule::WordMatch;
+            using WordMatches = Rule::WordMatches;
+
+            // one of the arrays, either built in memory or viewing a loaded image (see `from_image`)
+            template<typename T> class Table {
+                std::vector<T> owned{};
+                const T* items = nullptr;
+                size_t count = 0;
+                bool view = false;
+
+              public:
+                Table() = default;
+                Table(const std::initializer_list<T> init) : owned{init}, items{owned.data()}, count{owned.size()} {}
+                Table(const T* items, const size_t count) : items{items}, count{count}, view{true} {}
+                Table(const Table& other)
+                    : owned{other.owned}, items{other.view ? other.items : owned.data()}, count{other.count}, view{other.view} {}
+                // moving a vector keeps its buffer, so `items` stays valid
+                Table(Table&& other) = default;
+                Table& operator=(const Table& other) {
+                    if (this == &other)
+                        return *this;
+                    this->~Table();
+                    new (this) Table{other};
+                    return *this;
+                }
+                Table& operator=(Table&& other) = default;
+
+                // only for tables built in memory
+                void emplace_back(const T& value) {
+                    owned.emplace_back(value);
+                    items = owned.data();
+                    ++count;
+                }
+                void append(const T* values, const size_t size) {
+                    owned.insert(owned.end(), values, values + size);
+                    items = owned.data();
+                    count += size;
+                }
+
+                const T* data() const { return items; }
+                size_t size() const { return count; }
+                const T& operator[](const size_t i) const { return items[i]; }
+                bool operator==(const Table& other) const {
+                    return count == other.count && std::equal(items, items + count, other.items);
+                }
+            };
+
+            Table<Word::Type> kinds{};
+            Table<uint8_t> flags{};
+            Table<Index> literal_offsets{0};
+            Table<char> literals{};
+            Table<Index> rule_offsets{0};
+            std::unordered_map<size_t, std::string> invalid_rules{};
+            uint64_t fingerprint = hash_seed;
+            // keeps the image viewed by the tables alive
+            std::shared_ptr<const void> image{};
+
+            Grammar() = default;
+            Grammar(const std::vector<Rule>& rules) {
+                for (const auto& rule : rules) add(rule);
+            }
+
+            void add(const Rule& rule) {
+                const auto valid = rule.is_valid();
+                if (valid.is_error())
+                    invalid_rules.emplace(num_rules(), valid.error().message);
+                else
+                    for (const auto& word : rule.words) {
+                        kinds.emplace_back(word.type().result());
+                        flags.emplace_back(static_cast<uint8_t>(word.optional().result()) |
+                                           static_cast<uint8_t>(word.repeat().result()) << 2);
+                        literals.append(word.word.data() + 3, word.word.size() - 3);
+                        literal_offsets.emplace_back(static_cast<Index>(literals.size()));
+                    }
+                rule_offsets.emplace_back(static_cast<Index>(kinds.size()));
+                fingerprint = hash(fingerprint, rule);
+            }
+
+            // fnv-1a over every word of every rule, used to tell whether `System::rules` changed since compilation
+            static constexpr uint64_t hash_seed = 14695981039346656037ull;
+            static uint64_t hash(uint64_t h, const Rule& rule) {
+                for (const auto& word : rule.words) {
+                    for (const char c : word.word) h = (h ^ static_cast<uint8_t>(c)) * 1099511628211ull;
+                    h = (h ^ 0xffu) * 1099511628211ull;
+                }
+                return (h ^ 0xfeu) * 1099511628211ull;
+            }
+            static uint64_t hash(const std::vector<Rule>& rules) {
+                uint64_t h = hash_seed;
+                for (const auto& rule : rules) h = hash(h, rule);
+                return h;
+            }
+
+            // the same rules, compiled the same way
+            bool operator==(const Grammar& other) const {
+                return fingerprint == other.fingerprint && kinds == other.kinds && flags == other.flags &&
+                       literal_offsets == other.literal_offsets && literals == other.literals &&
+                       rule_offsets == other.rule_offsets && invalid_rules == other.invalid_rules;
+            }
+            bool operator!=(const Grammar& other) const { return !(*this == other); }
+
+            // the tables written one after another into one buffer, with offsets instead of pointers, so it can be
+            // saved to a file and mapped back into memory without parsing (see `from_image`)
+            // images are only loaded by builds with the same byte order and `Index` size
+            struct ImageHeader {
+                char magic[8]{};
+                uint32_t version = 0;
+                uint32_t index_size = 0;
+                uint32_t byte_order = 0;
+                uint32_t reserved = 0;
+                // see `image_checksum`, over the whole image with this field set to 0
+                uint64_t checksum = 0;
+                uint64_t fingerprint = 0;
+                uint64_t num_rules = 0, num_words = 0, literals_size = 0, invalid_size = 0;
+                // offsets of the tables from the start of the image
+                uint64_t rule_offsets = 0, literal_offsets = 0, kinds = 0, flags = 0, literals = 0, invalid = 0;
             };
+            static constexpr char image_magic[8] = {'M', 'P', 'T', 'G', 'R', 'A', 'M', '\0'};
+            static constexpr uint32_t image_version = 2;
+            static constexpr uint32_t image_byte_order = 0x01020304;
+
+            // fnv-1a taking 8 bytes at a time, so checking a large image costs little next to mapping it
+            static uint64_t checksum(const char* data, const size_t size, uint64_t h = hash_seed) {
+                size_t i = 0;
+                for (; i + 8 <= size; i += 8) {
+                    uint64_t block = 0;
+                    std::memcpy(&block, data + i, 8);
+                    h = (h ^ block) * 1099511628211ull;
+                }
+                for (; i < size; i++) h = (h ^ static_cast<uint8_t>(data[i])) * 1099511628211ull;
+                return h;
+            }
+            // the header is covered too, a damaged fingerprint would otherwise go unnoticed and mix up the outputs
+            // cached for this grammar with those of another one
+            static uint64_t image_checksum(ImageHeader header, const char* data, const size_t size) {
+                header.checksum = 0;
+                const auto h = checksum(reinterpret_cast<const char*>(&header), sizeof(header));
+                return checksum(data + sizeof(header), size - sizeof(header), h);
+            }
+
+            std::string to_image() const {
+                ImageHeader header{};
+                std::copy(image_magic, image_magic + sizeof(image_magic), header.magic);
+                header.version = image_version;
+                header.index_size = sizeof(Index);
+                header.byte_order = image_byte_order;
+                header.fingerprint = fingerprint;
+                header.num_rules = num_rules();
+                header.num_words = kinds.size();
+                header.literals_size = literals.size();
+
+                std::string res(sizeof(ImageHeader), '\0');
+                // every table starts 8 byte aligned
+                const auto add_table = [&res](const void* data, const size_t size) {
+                    res.resize((res.size() + 7) / 8 * 8, '\0');
+                    const uint64_t offset = res.size();
+                    res.append(static_cast<const char*>(data), size);
+                    return offset;
+                };
+                header.rule_offsets = add_table(rule_offsets.data(), rule_offsets.size() * sizeof(Index));
+                header.literal_offsets = add_table(literal_offsets.data(), literal_offsets.size() * sizeof(Index));
+                header.kinds = add_table(kinds.data(), kinds.size());
+                header.flags = add_table(flags.data(), flags.size());
+                header.literals = add_table(literals.data(), literals.size());
+                // invalid rules are listed as (rule, message size, message), sorted by rule
+                std::string invalid{};
+                std::vector<std::pair<uint64_t, const std::string*>> sorted{};
+                for (const auto& [rule, message] : invalid_rules) sorted.emplace_back(rule, &message);
+                std::sort(sorted.begin(), sorted.end());
+                for (const auto& [rule, message] : sorted) {
+                    const uint64_t size = message->size();
+                    invalid.append(reinterpret_cast<const char*>(&rule), sizeof(rule));
+                    invalid.append(reinterpret_cast<const char*>(&size), sizeof(size));
+                    invalid += *message;
+                }
+                header.invalid = add_table(invalid.data(), invalid.size());
+                header.invalid_size = invalid.size();
+
+                header.checksum = image_checksum(header, res.data(), res.size());
+                std::memcpy(res.data(), &header, sizeof(header));
+                return res;
+            }
+
+            // a grammar viewing an image made by `to_image`, without copying or parsing its tables
+            // `data` has to be 8 byte aligned and stay valid as long as `owner` does (the grammar keeps it alive)
+            // the image is checked (version, checksum, and that every offset is in bounds) before it's used
+            static Result<std::shared_ptr<const Grammar>> from_image(const char* data, const size_t size,
+                                                                     std::shared_ptr<const void> owner) {
+                ImageHeader header{};
+                if (size < sizeof(header))
+                    return Error{1, "Image is too small"};
+                std::memcpy(&header, data, sizeof(header));
+                if (!std::equal(image_magic, image_magic + sizeof(image_magic), header.magic))
+                    return Error{2, "Not a grammar image"};
+                if (header.version != image_version)
+                    return Error{3, "Unsupported grammar image version " + std::to_string(header.version)};
+                if (header.byte_order != image_byte_order || header.index_size != sizeof(Index))
+                    return Error{4, "Grammar image was made for a different byte order or index size"};
+                if (reinterpret_cast<uintptr_t>(data) % 8 != 0)
+                    return Error{5, "Grammar image is not aligned"};
+                if (image_checksum(header, data, size) != header.checksum)
+                    return Error{6, "Grammar image checksum doesn't match"};
+
+                const auto fits = [&](const uint64_t offset, const uint64_t count, const uint64_t item_size) {
+                    return offset % 8 == 0 && offset >= sizeof(header) && offset <= size &&
+                           count <= (size - offset) / item_size;
+                };
+                const uint64_t num_words = header.num_words;
+                if (!fits(header.rule_offsets, header.num_rules + 1, sizeof(Index)) ||
+                    !fits(header.literal_offsets, num_words + 1, sizeof(Index)) || !fits(header.kinds, num_words, 1) ||
+                    !fits(header.flags, num_words, 1) || !fits(header.literals, header.literals_size, 1) ||
+                    !fits(header.invalid, header.invalid_size, 1))
+                    return Error{7, "Grammar image table out of bounds"};
+
+                auto res = std::make_shared<Grammar>();
+                res->rule_offsets = {reinterpret_cast<const Index*>(data + header.rule_offsets), header.num_rules + 1};
+                res->literal_offsets = {reinterpret_cast<const Index*>(data + header.literal_offsets), num_words + 1};
+                res->kinds = {reinterpret_cast<const Word::Type*>(data + header.kinds), num_words};
+                res->flags = {reinterpret_cast<const uint8_t*>(data + header.flags), num_words};
+                res->literals = {data + header.literals, header.literals_size};
+                res->fingerprint = header.fingerprint;
+
+                // offsets have to grow and stay inside their tables, so matching never reads out of bounds
+                const auto& rules = res->rule_offsets;
+                const auto& offsets = res->literal_offsets;
+                bool valid = rules[0] == 0 && rules[header.num_rules] == num_words && offsets[0] == 0 &&
+                             offsets[num_words] == header.literals_size;
+                for (size_t i = 0; valid && i < num_words; i++)
+                    valid = offsets[i] <= offsets[i + 1] && static_cast<uint8_t>(res->kinds[i]) <= 4 &&
+                            (res->flags[i] & 3) <= 2 && (res->flags[i] >> 2) <= 2;
+                if (!valid)
+                    return Error{8, "Grammar image tables are inconsistent"};
+
+                for (uint64_t at = 0; at < header.invalid_size;) {
+                    uint64_t rule = 0, message_size = 0;
+                    if (header.invalid_size - at < sizeof(rule) + sizeof(message_size))
+                        return Error{8, "Grammar image tables are inconsistent"};
+                    std::memcpy(&rule, data + header.invalid + at, sizeof(rule));
+                    std::memcpy(&message_size, data + header.invalid + at + sizeof(rule), sizeof(message_size));
+                    at += sizeof(rule) + sizeof(message_size);
+                    if (message_size > header.invalid_size - at)
+                        return Error{8, "Grammar image tables are inconsistent"};
+                    res->invalid_rules.emplace(rule, std::string{data + header.invalid + at, message_size});
+                    at += message_size;
+                }
+                // like rules checked by `Rule::is_valid`, every rule that isn't invalid ends with its expand word
+                for (size_t i = 0; valid && i < header.num_rules; i++)
+                    valid = rules[i] <= rules[i + 1] &&
+                            (res->invalid_rules.count(i) != 0 ||
+                             (rules[i] < rules[i + 1] && res->kinds[rules[i + 1] - 1] == Word::Type::EXPAND));
+                if (!valid)
+                    return Error{8, "Grammar image tables are inconsistent"};
+                res->image = std::move(owner);
+                return std::shared_ptr<const Grammar>{std::move(res)};
+            }
+
+            size_t num_rules() const { return rule_offsets.size() - 1; }
+            size_t rule_size(const size_t rule) const { return rule_offsets[rule + 1] - rule_offsets[rule]; }
+
+            Word::Type type(const size_t word) const { return kinds[word]; }
+            Word::OptionalType optional(const size_t word) const { return static_cast<Word::OptionalType>(flags[word] & 3); }
+            Word::RepeatType repeat(const size_t word) const { return static_cast<Word::RepeatType>(flags[word] >> 2); }
+            const char* literal(const size_t word) const { return literals.data() + literal_offsets[word]; }
+            size_t literal_size(const size_t word) const { return literal_offsets[word + 1] - literal_offsets[word]; }
+            std::string literal_str(const size_t word) const { return {literal(word), literal_size(word)}; }
+
+            // how well `words` (found by matching `rule`) match: the matched fraction of the rule, or 2 for full matches
+            // of rules ending in a direct word, which can't be beaten
+            float score(const size_t rule, const WordMatches& words) const {
+                if (words.empty())
+                    return 0.0f;
+                const size_t size = rule_size(rule);
+                const float res = float(words.back().id + 1) / float(size);
+                if (res == 1.0f && size >= 2 && type(rule_offsets[rule] + size - 2) == Word::Type::DIRECT)
+                    return 2.0f;
+                return res;
+            }
 
           private:
-            Result<std::pair<size_t, size_t>> ensure_word_match(const Source& str, const size_t word_id,
-                                                                size_t* found_word_b_return = nullptr) const {
-                const auto& word = words[word_id];
-                const auto type = word.type().result();
-                switch (type) {
+            // `first` is the index of the rule's first word, `word_id` is relative to it
+            // if `reach` is set, it's moved up to the end of the furthest word read
+            Result<std::pair<size_t, size_t>> ensure_word_match(const Source& str, const size_t first, const size_t num_words,
+                                                                const size_t word_id, size_t* found_word_b_return = nullptr,
+                                                                size_t* reach = nullptr) const {
+                const size_t word = first + word_id;
+                // a word that isn't found was looked for until the end
+                const auto read = [&](const std::pair<size_t, size_t>& found) {
+                    if (reach)
+                        *reach = std::max(*reach, found.second == 0 ? static_cast<size_t>(str.size()) : found.second);
+                    return found;
+                };
+                switch (type(word)) {
                     case Word::Type::DIRECT: {
                         if (found_word_b_return) {
-                            const auto first_word = get_first_word(str, true);
+                            const auto first_word = read(get_first_word(str, true));
                             *found_word_b_return = first_word.second;
                         }
-                        const auto word_desc = get_first_word(str, false);
+                        const auto word_desc = read(get_first_word(str, false));
                         if (word_desc.second - word_desc.first == 0)
                             return Error{-1, "Expected word"};
-                        if (!(str + (word_desc.first - str.pos.pos)).matches(word.word.substr(3)))
+                        read({word_desc.first, word_desc.first + literal_size(word)});
+                        if (!str.matches(literal(word), literal_size(word), word_desc.first))
                             return Error{-1, "Word does not match expected word"};
-                        return std::pair{word_desc.first, word_desc.first + word.word.size() - 3};
+                        return std::pair{word_desc.first, word_desc.first + literal_size(word)};
                     }
                     case Word::Type::GENERIC: {
-                        if (word_id == num_words() - 1) {
-                            const auto first_word = get_first_word(str, true);
+                        if (word_id == num_words - 1) {
+                            const auto first_word = read(get_first_word(str, true));
                             if (first_word.second - first_word.first == 0)
                                 return Error{-1, "Expected word"};
                             if (found_word_b_return)
                                 *found_word_b_return = first_word.second;
                             return first_word;
                         }
-                        auto first_word = get_first_word(str, true);
+                        auto first_word = read(get_first_word(str, true));
                         auto str_cpy = str;
                         if (first_word.second - first_word.first == 0)
                             return Error{-1, "Expected word"};
                         size_t i = first_word.second;
                         size_t next_word_id = word_id + 1;
                         size_t backup_word = next_word_id;
-                        while (words[backup_word].repeat().result() == Word::RepeatType::REPEAT) ++backup_word;
+                        while (repeat(first + backup_word) == Word::RepeatType::REPEAT) ++backup_word;
                         System::Result<std::pair<size_t, size_t>> next_word_match = Error{};
                         do {
                             const size_t _i = i;
                             str_cpy += i - str_cpy.pos.pos;
-                            next_word_match = ensure_word_match(str_cpy, next_word_id, &i);
-                            if (word.repeat().result() == Word::RepeatType::REPEAT && next_word_match.is_error())
-                                next_word_match = ensure_word_match(str_cpy, backup_word, &i);
-                            if (str_cpy.reached_end() || _i == i)
+                            next_word_match = ensure_word_match(str_cpy, first, num_words, next_word_id, &i, reach);
+                            if (repeat(word) == Word::RepeatType::REPEAT && next_word_match.is_error())
+                                next_word_match = ensure_word_match(str_cpy, first, num_words, backup_word, &i, reach);
+                            if (str_cpy.reached_end() || _i == i) {
+                                read({});
                                 return Error{-1, "Reached end of string without finding next word"};
+                            }
                         }
                         while (next_word_match.is_error());
                         i = next_word_match.result().first;
@@ -687,37 +1343,43 @@ namespace mgm {
             }
 
           public:
-            Result<std::vector<WordMatch>, std::pair<std::vector<WordMatch>, CompilationError>> match(const Source& str) const {
+            using MatchResult = Result<WordMatches, std::pair<WordMatches, CompilationError>>;
+
+            // if `reach` is set, it's moved up to the end of the furthest word the match read, which can be past the
+            // words it matched
+            Result<WordMatches, std::pair<WordMatches, CompilationError>> match(const size_t rule, const Source& str,
+                                                                                size_t* reach = nullptr) const {
                 if (str.empty())
                     return std::pair{
-                        std::vector<WordMatch>{},
+                        WordMatches{},
                         CompilationError{{}, "String is empty", CompilationError::Severity::ERROR}
                     };
-                const auto valid = is_valid();
-                if (valid.is_error())
+                const auto invalid = invalid_rules.find(rule);
+                if (invalid != invalid_rules.end())
                     return std::pair{
-                        std::vector<WordMatch>{},
-                        CompilationError{{}, valid.error().message, CompilationError::Severity::SYSTEM_ERROR}
+                        WordMatches{},
+                        CompilationError{{}, invalid->second, CompilationError::Severity::SYSTEM_ERROR}
                     };
 
-                std::vector<WordMatch> res{};
-                res.reserve(words.size());
+                const size_t first = rule_offsets[rule];
+                const size_t num_words = rule_size(rule);
+
+                WordMatches res{};
+                res.reserve(num_words);
 
                 size_t i = 0;
-                size_t pos = 0;
+                size_t pos = str.pos.pos;
                 bool repeating = 0;
 
-                while (i < words.size()) {
-                    auto word_match = ensure_word_match(str + pos, i);
+                while (i < num_words) {
+                    // `pos` is absolute, the cursor continues from where the previous word ended
+                    const auto cursor = str + (pos - str.pos.pos);
+                    auto word_match = ensure_word_match(cursor, first, num_words - 1, i, nullptr, reach);
                     if (word_match.is_error()) {
-                        if (words[i].empty()) {
-                            ++i;
-                            continue;
-                        }
-                        if (words[i].repeat().result() == Word::RepeatType::REPEAT_SINGLE) {
-                            if (!repeating && words[i].optional().result() != Word::OptionalType::OPTIONAL)
+                        if (repeat(first + i) == Word::RepeatType::REPEAT_SINGLE) {
+                            if (!repeating && optional(first + i) != Word::OptionalType::OPTIONAL)
                                 return std::pair{
-                                    res, CompilationError{(str + pos).pos, "Single repeating word not found",
+                                    res, CompilationError{cursor.pos, "Single repeating word not found",
                                                           CompilationError::Severity::ERROR}
                                 };
                             repeating = false;
@@ -725,54 +1387,54 @@ namespace mgm {
                             continue;
                         }
                         if (repeating) {
-                            if (words[i].repeat().result() == Word::RepeatType::REPEAT) {
-                                while (words[i].repeat().result() == Word::RepeatType::REPEAT) ++i;
-                                word_match = ensure_word_match(str + pos, i);
+                            if (repeat(first + i) == Word::RepeatType::REPEAT) {
+                                while (repeat(first + i) == Word::RepeatType::REPEAT) ++i;
+                                word_match = ensure_word_match(cursor, first, num_words - 1, i, nullptr, reach);
                                 if (!word_match.is_error())
                                     continue;
                             }
                             if (i > 0) {
-                                while (words[i - 1].repeat().result() == Word::RepeatType::REPEAT) {
+                                while (repeat(first + i - 1) == Word::RepeatType::REPEAT) {
                                     --i;
                                     if (i == 0)
                                         break;
                                 }
-                                word_match = ensure_word_match(str + pos, i);
+                                word_match = ensure_word_match(cursor, first, num_words - 1, i, nullptr, reach);
                                 if (!word_match.is_error())
                                     continue;
                             }
                             return std::pair{
-                                res, CompilationError{(str + pos).pos,
+                                res, CompilationError{cursor.pos,
                                                       "Repeating word not found or no closer was found after repeating words", CompilationError::Severity::ERROR}
                             };
                         }
-                        if (words[i].optional().result() == Word::OptionalType::OPTIONAL) {
+                        if (optional(first + i) == Word::OptionalType::OPTIONAL) {
                             ++i;
                             continue;
                         }
-                        if (words[i].optional().result() == Word::OptionalType::OPTIONAL_LIST_MANDATORY_ONE) {
-                            if (words[i + 1].optional().result() != Word::OptionalType::OPTIONAL_LIST_MANDATORY_ONE)
+                        if (optional(first + i) == Word::OptionalType::OPTIONAL_LIST_MANDATORY_ONE) {
+                            if (optional(first + i + 1) != Word::OptionalType::OPTIONAL_LIST_MANDATORY_ONE)
                                 return std::pair{
                                     res,
-                                    CompilationError{(str + pos).pos, "Word should match at least one option in optional list",
+                                    CompilationError{cursor.pos, "Word should match at least one option in optional list",
                                                      CompilationError::Severity::ERROR}
                                 };
-                            while (words[i].optional().result() == Word::OptionalType::OPTIONAL_LIST_MANDATORY_ONE) ++i;
+                            while (optional(first + i) == Word::OptionalType::OPTIONAL_LIST_MANDATORY_ONE) ++i;
                             continue;
                         }
                         return std::pair{
                             res,
-                            CompilationError{(str + pos).pos, std::string{"Word \""} + words[i].word.substr(3) + "\" not found",
+                            CompilationError{cursor.pos, std::string{"Word \""} + literal_str(first + i) + "\" not found",
                                              CompilationError::Severity::ERROR}
                         };
                     }
                     pos = word_match.result().second;
-                    res.emplace_back(WordMatch{i, word_match.result()});
+                    res.emplace_back(WordMatch{static_cast<Index>(i), word_match.result()});
 
-                    if (words[i].optional().result() == Word::OptionalType::OPTIONAL_LIST_MANDATORY_ONE)
-                        while (words[i + 1].optional().result() == Word::OptionalType::OPTIONAL_LIST_MANDATORY_ONE) ++i;
+                    if (optional(first + i) == Word::OptionalType::OPTIONAL_LIST_MANDATORY_ONE)
+                        while (optional(first + i + 1) == Word::OptionalType::OPTIONAL_LIST_MANDATORY_ONE) ++i;
 
-                    switch (words[i].repeat().result()) {
+                    switch (repeat(first + i)) {
                         case Word::RepeatType::ONCE:
                             ++i;
                             repeating = false;
@@ -790,12 +1452,213 @@ namespace mgm {
             }
         };
 
+        // a compiled grammar that can be replaced while other threads parse with it, see `follow`
+        // a new grammar is published with a version number, readers compare the version before loading the grammar, so
+        // reading an unchanged grammar takes no lock, and an old grammar is freed once the last parse using it is done
+        class LiveGrammar {
+            std::shared_ptr<const Grammar> current{};
+            std::atomic<size_t> current_version{0};
+
+          public:
+            LiveGrammar(std::shared_ptr<const Grammar> grammar) : current{std::move(grammar)} {}
+            LiveGrammar(const LiveGrammar&) = delete;
+            LiveGrammar& operator=(const LiveGrammar&) = delete;
+
+            void publish(std::shared_ptr<const Grammar> grammar) {
+                std::atomic_store(&current, std::move(grammar));
+                current_version.fetch_add(1, std::memory_order_release);
+            }
+            std::shared_ptr<const Grammar> load() const { return std::atomic_load(&current); }
+            size_t version() const { return current_version.load(std::memory_order_acquire); }
+        };
+
+      public:
+        // runs the work of the parallel features (see `set_executor`), so they can run on an existing thread pool
+        struct Executor {
+            // runs `task` at some point, on any thread (including the calling one)
+            virtual void submit(std::function<void()> task) = 0;
+            // runs one task that was submitted but not started yet on the calling thread, instead of waiting for it,
+            // returns false if there was none
+            virtual bool run_pending() { return false; }
+            // number of tasks that can run at the same time, counting the thread that submits them
+            virtual size_t concurrency() const = 0;
+
+            virtual ~Executor() = default;
+        };
+
+        // runs every task right away on the calling thread, which makes all parallel features serial and deterministic
+        struct InlineExecutor : public Executor {
+            void submit(std::function<void()> task) override { task(); }
+            size_t concurrency() const override { return 1; }
+        };
+
+        // the default executor, a pool of threads with one queue each
+        // threads take their newest task first and take the oldest task of another queue when they have nothing to do
+        // (work stealing), so the work of a deep task tree spreads out from the top
+        class ThreadPool : public Executor {
+            struct Queue {
+                std::mutex mutex{};
+                std::deque<std::function<void()>> tasks{};
+            };
+            // one queue per thread, and a last one for tasks submitted from other threads
+            std::vector<std::unique_ptr<Queue>> queues{};
+            std::vector<std::thread> threads{};
+            std::mutex mutex{};
+            std::condition_variable wake{};
+            std::atomic<size_t> queued{0};
+            bool stop = false;
+
+            // the pool the current thread belongs to and its queue
+            inline static thread_local ThreadPool* current_pool = nullptr;
+            inline static thread_local size_t current_queue = 0;
+
+            size_t own_queue() const { return current_pool == this ? current_queue : queues.size() - 1; }
+
+            bool run_one(const size_t own) {
+                std::function<void()> task{};
+                for (size_t i = 0; i < queues.size() && !task; i++) {
+                    auto& queue = *queues[(own + i) % queues.size()];
+                    std::lock_guard lock{queue.mutex};
+                    if (queue.tasks.empty())
+                        continue;
+                    if (i == 0) {
+                        task = std::move(queue.tasks.back());
+                        queue.tasks.pop_back();
+                    }
+                    else {
+                        task = std::move(queue.tasks.front());
+                        queue.tasks.pop_front();
+                    }
+                }
+                if (!task)
+                    return false;
+                --queued;
+                task();
+                return true;
+            }
+
+            void work(const size_t index) {
+                current_pool = this;
+                current_queue = index;
+                while (true) {
+                    if (run_one(index))
+                        continue;
+                    std::unique_lock lock{mutex};
+                    wake.wait(lock, [&]() { return stop || queued > 0; });
+                    if (stop)
+                        return;
+                }
+            }
+
+          public:
+            // `num_threads` threads are started, all hardware threads but the calling one if 0
+            ThreadPool(size_t num_threads = 0) {
+                if (num_threads == 0)
+                    num_threads = std::max(2u, std::thread::hardware_concurrency()) - 1;
+                for (size_t i = 0; i <= num_threads; i++) queues.emplace_back(std::make_unique<Queue>());
+                for (size_t i = 0; i < num_threads; i++) threads.emplace_back([this, i]() { work(i); });
+            }
+            ThreadPool(const ThreadPool&) = delete;
+            ThreadPool& operator=(const ThreadPool&) = delete;
+
+            void submit(std::function<void()> task) override {
+                {
+                    auto& queue = *queues[own_queue()];
+                    std::lock_guard lock{queue.mutex};
+                    queue.tasks.emplace_back(std::move(task));
+                }
+                {
+                    std::lock_guard lock{mutex};
+                    ++queued;
+                }
+                wake.notify_one();
+            }
+            bool run_pending() override { return run_one(own_queue()); }
+            size_t concurrency() const override { return threads.size() + 1; }
+
+            ~ThreadPool() override {
+                {
+                    std::lock_guard lock{mutex};
+                    stop = true;
+                }
+                wake.notify_all();
+                for (auto& thread : threads) thread.join();
+            }
+        };
+
+        // counts work that is not done yet
+        // `done` still uses the group after the count drops to 0, so it has to outlive the work (the tasks can share it)
+        class WaitGroup {
+            std::atomic<size_t> count{0};
+            mutable std::mutex mutex{};
+            mutable std::condition_variable finished{};
+
+          public:
+            void add(const size_t n = 1) { count += n; }
+            void done() {
+                if (count.fetch_sub(1, std::memory_order_acq_rel) != 1)
+                    return;
+                // taken so a waiter that just saw work left can't miss the wake up before it sleeps
+                std::lock_guard lock{mutex};
+                finished.notify_all();
+            }
+            bool is_done() const { return count.load(std::memory_order_acquire) == 0; }
+
+            // runs other tasks of `executor` while waiting, so waiting from inside a task never blocks the executor, and
+            // sleeps once there are none left to run (the rest of the work is running on other threads then)
+            void wait(Executor& executor) const {
+                while (!is_done()) {
+                    if (executor.run_pending())
+                        continue;
+                    std::unique_lock lock{mutex};
+                    finished.wait(lock, [this]() { return is_done(); });
+                }
+            }
+        };
+
+        // calls `f(i)` for every i in [0, count) on up to `executor.concurrency()` threads (the calling one included),
+        // indices are handed out one at a time, and returns once all calls are done
+        // the caller only waits for calls that were started, helpers that start late find nothing left and return, so
+        // this can't deadlock on an executor whose threads are all busy
+        template<typename F> static void bulk_for(Executor& executor, const size_t count, const F& f) {
+            struct State {
+                std::atomic<size_t> next{0};
+                WaitGroup group{};
+            };
+            const auto state = std::make_shared<State>();
+            state->group.add(count);
+            const auto run = [state, &f, count]() {
+                for (size_t i = state->next++; i < count; i = state->next++) {
+                    f(i);
+                    state->group.done();
+                }
+            };
+            const size_t helpers = count == 0 ? 0 : std::min(executor.concurrency(), count) - 1;
+            for (size_t i = 0; i < helpers; i++) executor.submit(run);
+            run();
+            state->group.wait(executor);
+        }
+
+      public:
         struct Extension {
             Extension() = default;
 
             virtual Result<std::string> operator()(System& system, const GenericValueMap& found_words,
                                                    const std::string& params = "") = 0;
 
+            // a pure extension's result only depends on its arguments (it keeps no state between calls), which lets
+            // statements using it be parsed in parallel (see `parse_parallel`)
+            virtual bool is_pure() const { return false; }
+            // should change whenever the extension's output changes for the same arguments, so outputs cached with an
+            // older version aren't used (see `System::fingerprint`)
+            virtual uint64_t version() const { return 0; }
+            // an extension that is not pure can still have the output of parses calling it cached (see
+            // `mgm::OutputCache`) if `saves_state` returns true, all of its state is in what `save_state` returns, and
+            // `load_state` takes it back
+            virtual bool saves_state() const { return false; }
+            virtual std::string save_state() const { return {}; }
+            virtual void load_state(const std::string&) {}
+
             virtual ~Extension() = default;
         };
 
@@ -849,6 +1712,15 @@ namespace mgm {
                 return (*extension)(system, found_words, params);
             }
 
+            bool is_pure() const { return extension && extension->is_pure(); }
+            uint64_t version() const { return extension ? extension->version() : 0; }
+            bool saves_state() const { return extension && extension->saves_state(); }
+            std::string save_state() const { return extension ? extension->save_state() : std::string{}; }
+            void load_state(const std::string& state) {
+                if (extension)
+                    extension->load_state(state);
+            }
+
             template<typename T> T& get() { return *dynamic_cast<T*>(extension); }
             template<typename T> const T& get() const { return *dynamic_cast<T*>(extension); }
 
@@ -856,71 +1728,973 @@ namespace mgm {
         };
 
       public:
-        std::vector<Rule> rules{};
-        std::unordered_map<std::string, ExtensionContainer> extensions{};
+        // receives parse output in order, as soon as each top-level statement is done
+        struct Sink {
+            virtual void write(const char* data, size_t size) = 0;
+            virtual void flush() {}
 
-        template<typename T, typename... Ts,
-                 std::enable_if_t<std::is_base_of_v<Extension, T> && std::is_constructible_v<T, Ts...>, bool> = true>
-        void add_extension(const std::string& name, Ts&&... args) {
-            extensions[name].emplace<T>(std::forward<T>(args)...);
-        }
+            virtual ~Sink() = default;
+        };
+        struct OstreamSink : public Sink {
+            std::ostream& stream;
 
-      private:
-        struct ExpandCountExtension : public Extension {
-            using Extension::Extension;
-            size_t count{};
-            std::unordered_map<std::string, size_t> counts{};
-            System::Result<std::string> operator()(System& system, const System::GenericValueMap& found_words,
-                                                   const std::string& params) override {
-                if (params.empty())
-                    return std::to_string(count++);
+            OstreamSink(std::ostream& stream) : stream{stream} {}
 
-                const auto word = get_first_word(params, false);
-                if (word.second == 0)
-                    return Error{-1, "No word to expand"};
-                const auto var = params.substr(word.first, word.second - word.first);
+            void write(const char* data, size_t size) override { stream.write(data, static_cast<std::streamsize>(size)); }
+            void flush() override { stream.flush(); }
+        };
+        struct CallbackSink : public Sink {
+            std::function<void(const char* data, size_t size)> callback{};
 
-                if (var == "RESET") {
-                    count = 0;
-                    counts.clear();
-                    return std::to_string(count++);
-                }
+            CallbackSink(std::function<void(const char* data, size_t size)> callback) : callback{std::move(callback)} {}
 
-                const auto it = counts.find(var);
-                if (it == counts.end())
-                    return std::to_string(counts.emplace(var, 0).first->second++);
-                return std::to_string(it->second++);
-            }
+            void write(const char* data, size_t size) override { callback(data, size); }
         };
 
-      public:
-        void enable_default_extensions() {
-            extensions.clear();
-            add_extension<ExpandCountExtension>("EXPAND_COUNT", ExpandCountExtension{});
-        }
-        System(const std::vector<Rule>& rules = {}, const std::unordered_map<std::string, ExtensionContainer>& extensions = {})
-            : rules{rules}, extensions{extensions} {}
-        System(const System& other) = default;
-        System(System&& other) = default;
-        System& operator=(const System& other) = default;
-        System& operator=(System&& other) = default;
+        // output assembled from a list of chunks, so appending never moves bytes that were already written
+        // and nested parses can write into their parent's output directly
+        // large pieces of a source (quoted passthrough) are not copied, the output keeps a reference to them instead
+        // and `segments` lists every piece in order, ready to be handed to writev
+        class OutputBuilder {
+          public:
+            struct Segment {
+                const char* data = nullptr;
+                size_t size = 0;
+            };
 
-      private:
-        Result<std::string> expand_generic(const std::string& str, const GenericValueMap& expand_vars) {
-            const auto expr_to_expand = get_first_word(str, true);
-            if (expr_to_expand.second - expr_to_expand.first == 0)
-                return Error{-1, "Expected expression after $"};
+          private:
+            struct Chunk {
+                std::unique_ptr<char[]> data{};
+                size_t size = 0, capacity = 0;
+            };
+            static constexpr size_t chunk_size = 4096;
+            // shorter spans are copied, an extra segment costs more than copying a few bytes
+            static constexpr size_t min_reference_size = 64;
+            std::vector<Chunk> chunks{};
+            std::vector<Segment> output{};
+            // keeps referenced sources alive until the output is written or cleared
+            std::vector<std::shared_ptr<const void>> anchors{};
+            // places reserved for output that is added later (see `reserve_slot`), in order, `index` is in `output`
+            struct Slot {
+                size_t id = 0, index = 0;
+            };
+            std::vector<Slot> slots{};
+            size_t next_slot = 0;
+            // whether the last segment ends where the last chunk ends, so generated text can extend it
+            bool extend_last = false;
+            size_t total = 0;
+            size_t flushed = 0;
+
+            void add_segment(const char* data, const size_t len, const bool generated) {
+                if (extend_last && generated)
+                    output.back().size += len;
+                else
+                    output.emplace_back(Segment{data, len});
+                extend_last = generated;
+            }
 
-            if (str[expr_to_expand.first] == '(') {
-                std::vector<std::pair<std::string, Rule::Word::Type>> words_in_expr{};
-                std::vector<std::pair<size_t, size_t>> exprs_to_expand{};
-                size_t max_iterations = (size_t)-1;
-                for (size_t i = expr_to_expand.first + 1; i < expr_to_expand.second - 1; i++) {
-                    if (str[i] == '$') {
-                        ++i;
-                        auto word_to_expand = get_first_word(str.substr(i), true);
-                        word_to_expand = std::pair{word_to_expand.first + i, word_to_expand.second + i};
-                        if (str[word_to_expand.first] == '(') {
+          public:
+            OutputBuilder() = default;
+
+            void append(const char* data, size_t len) {
+                total += len;
+                if (!chunks.empty()) {
+                    auto& last = chunks.back();
+                    const size_t fits = std::min(len, last.capacity - last.size);
+                    if (fits != 0) {
+                        memcpy(last.data.get() + last.size, data, fits);
+                        add_segment(last.data.get() + last.size, fits, true);
+                        last.size += fits;
+                        data += fits;
+                        len -= fits;
+                    }
+                }
+                if (len == 0)
+                    return;
+                const size_t capacity = std::max(len, chunk_size);
+                chunks.emplace_back(Chunk{std::unique_ptr<char[]>{new char[capacity]}, len, capacity});
+                memcpy(chunks.back().data.get(), data, len);
+                extend_last = false;
+                add_segment(chunks.back().data.get(), len, true);
+            }
+            void append(const std::string& str) { append(str.data(), str.size()); }
+            OutputBuilder& operator+=(const std::string& str) {
+                append(str);
+                return *this;
+            }
+            // `data` has to stay valid for as long as `anchor` is alive
+            void append_ref(const char* data, const size_t len, const std::shared_ptr<const void>& anchor) {
+                if (len < min_reference_size) {
+                    append(data, len);
+                    return;
+                }
+                if (anchors.empty() || anchors.back() != anchor)
+                    anchors.emplace_back(anchor);
+                total += len;
+                add_segment(data, len, false);
+            }
+
+            // reserves a place for output that is only known later, output after it can be added already
+            // returns an id for `fill_slot`, nothing from the slot on is flushed until it is filled
+            size_t reserve_slot() {
+                output.emplace_back(Segment{});
+                extend_last = false;
+                slots.emplace_back(Slot{next_slot, output.size() - 1});
+                return next_slot++;
+            }
+            // puts the output of `other` in the reserved slot, taking over its storage instead of copying it
+            void fill_slot(const size_t id, OutputBuilder&& other) {
+                const auto slot = std::find_if(slots.begin(), slots.end(), [id](const Slot& slot) { return slot.id == id; });
+                if (slot == slots.end())
+                    return;
+                for (auto& chunk : other.chunks) chunks.emplace_back(std::move(chunk));
+                anchors.insert(anchors.end(), other.anchors.begin(), other.anchors.end());
+                // the last chunk is now one of `other`'s, which the last segment doesn't end in
+                extend_last = false;
+
+                const size_t index = slot->index;
+                output.erase(output.begin() + static_cast<ptrdiff_t>(index));
+                output.insert(output.begin() + static_cast<ptrdiff_t>(index), other.output.begin(), other.output.end());
+                for (auto it = slots.erase(slot); it != slots.end(); ++it) it->index = it->index + other.output.size() - 1;
+                total += other.total;
+                other = OutputBuilder{};
+            }
+            bool has_open_slots() const { return !slots.empty(); }
+
+            size_t size() const { return total; }
+            bool empty() const { return total == 0; }
+            // bytes handed to a sink by `flush_to` so far
+            size_t flushed_size() const { return flushed; }
+            const std::vector<Segment>& segments() const { return output; }
+
+            // keeps the first chunk around, so a builder that is flushed after every statement stops allocating
+            void clear() {
+                if (chunks.size() > 1)
+                    chunks.erase(chunks.begin() + 1, chunks.end());
+                if (!chunks.empty())
+                    chunks.front().size = 0;
+                output.clear();
+                anchors.clear();
+                slots.clear();
+                extend_last = false;
+                total = 0;
+            }
+
+            // writes everything up to the first slot that is not filled yet
+            void flush_to(Sink& sink) {
+                if (slots.empty()) {
+                    for (const auto& segment : output) sink.write(segment.data, segment.size);
+                    flushed += total;
+                    clear();
+                    return;
+                }
+                const size_t ready = slots.front().index;
+                size_t size = 0;
+                for (size_t i = 0; i < ready; i++) {
+                    sink.write(output[i].data, output[i].size);
+                    size += output[i].size;
+                }
+                // the storage is kept, output after the slot may still be in it
+                output.erase(output.begin(), output.begin() + static_cast<ptrdiff_t>(ready));
+                for (auto& slot : slots) slot.index -= ready;
+                total -= size;
+                flushed += size;
+            }
+
+            std::string str() const {
+                std::string res{};
+                res.reserve(total);
+                for (const auto& segment : output) res.append(segment.data, segment.size);
+                return res;
+            }
+        };
+
+        // list of rules shared between copies of a system, the first change made through a shared copy copies it
+        // (copy on write), so copying a system doesn't copy its rules
+        // references and iterators from non-const access are invalidated when the list is copied, like for a vector, and
+        // shouldn't be kept across a parse (the compiled list is shared, so changes through them might not be seen)
+        class RuleSet {
+            std::shared_ptr<std::vector<Rule>> rules{};
+
+            // makes `rules` owned by this set only, before it is changed
+            std::vector<Rule>& make_unique() {
+                if (!rules)
+                    rules = std::make_shared<std::vector<Rule>>();
+                else if (rules.use_count() > 1)
+                    rules = std::make_shared<std::vector<Rule>>(*rules);
+                return *rules;
+            }
+
+          public:
+            using iterator = std::vector<Rule>::iterator;
+            using const_iterator = std::vector<Rule>::const_iterator;
+
+            RuleSet() = default;
+            RuleSet(const std::vector<Rule>& rules) : rules{std::make_shared<std::vector<Rule>>(rules)} {}
+            RuleSet(std::vector<Rule>&& rules) : rules{std::make_shared<std::vector<Rule>>(std::move(rules))} {}
+            RuleSet(std::initializer_list<Rule> rules) : rules{std::make_shared<std::vector<Rule>>(rules)} {}
+
+            const std::vector<Rule>& vector() const {
+                static const std::vector<Rule> empty{};
+                return rules ? *rules : empty;
+            }
+            operator const std::vector<Rule>&() const { return vector(); }
+            // whether other systems share these rules
+            bool is_shared() const { return rules.use_count() > 1; }
+            // the list itself, two sets with the same storage hold the same rules
+            std::shared_ptr<const std::vector<Rule>> storage() const { return rules; }
+
+            size_t size() const { return vector().size(); }
+            bool empty() const { return vector().empty(); }
+            const Rule& operator[](const size_t i) const { return vector()[i]; }
+            const Rule& front() const { return vector().front(); }
+            const Rule& back() const { return vector().back(); }
+            const_iterator begin() const { return vector().begin(); }
+            const_iterator end() const { return vector().end(); }
+            const_iterator cbegin() const { return vector().cbegin(); }
+            const_iterator cend() const { return vector().cend(); }
+
+            Rule& operator[](const size_t i) { return make_unique()[i]; }
+            Rule& front() { return make_unique().front(); }
+            Rule& back() { return make_unique().back(); }
+            iterator begin() { return make_unique().begin(); }
+            iterator end() { return make_unique().end(); }
+
+            template<typename... Ts> Rule& emplace_back(Ts&&... args) {
+                return make_unique().emplace_back(std::forward<Ts>(args)...);
+            }
+            void push_back(const Rule& rule) { make_unique().push_back(rule); }
+            void push_back(Rule&& rule) { make_unique().push_back(std::move(rule)); }
+            void pop_back() { make_unique().pop_back(); }
+            // `pos` stays valid even though the rules may have to be copied first, only its offset is used
+            iterator insert(const const_iterator pos, const Rule& rule) {
+                const auto offset = pos - cbegin();
+                auto& list = make_unique();
+                return list.insert(list.begin() + offset, rule);
+            }
+            iterator erase(const const_iterator pos) {
+                const auto offset = pos - cbegin();
+                auto& list = make_unique();
+                return list.erase(list.begin() + offset);
+            }
+            void reserve(const size_t size) { make_unique().reserve(size); }
+            void clear() { rules.reset(); }
+        };
+
+      public:
+        RuleSet rules{};
+        std::unordered_map<std::string, ExtensionContainer> extensions{};
+        // matches all rules for a statement at once on the executor (see `set_executor`), which lowers the latency of
+        // single parses with large rule sets, the result is the same, ties are still resolved by rule order
+        bool parallel_rules = false;
+        // parses expansions as tasks on the executor instead of right away, so wide and deeply nested expansions use
+        // more than one thread
+        // the result is the same: expansions that call extensions which are not pure are parsed again in order, and
+        // all tasks are finished before this system calls such an extension itself
+        bool parallel_expansions = false;
+        // directory of the input, files it includes with `$INCLUDE` by a relative path are looked up there
+        std::string include_directory{};
+
+      private:
+        std::shared_ptr<const Grammar> grammar{};
+        // the rules `grammar` was compiled from, holding them also makes any change to them copy them first
+        std::shared_ptr<const std::vector<Rule>> compiled_rules{};
+        size_t parse_depth = 0;
+        // number of calls to extensions that are not pure, see `Extension::is_pure`
+        size_t impure_calls = 0;
+        // of those, calls to extensions that can't save their state, see `Extension::saves_state`
+        size_t unsaved_calls = 0;
+        std::shared_ptr<Executor> executor{};
+        // smaller grammars are matched one rule after another, handing out the rules would cost more than matching them
+        static constexpr size_t min_parallel_rules = 32;
+        // shorter expansions are parsed right away, a task would cost more than parsing them
+        static constexpr size_t min_task_size = 256;
+
+        // the parse of an expansion, running as a task
+        struct NestedParse {
+            Source text{};
+            // the statement that expanded to `text`, errors are reported relative to it
+            Source at{};
+            const Grammar* grammar = nullptr;
+            size_t slot = 0, errors_index = 0;
+            OutputBuilder output{};
+            std::vector<CompilationError> errors{};
+            bool impure = false;
+            // claimed by the thread that runs the task, which is either one of the executor's or the one joining it
+            std::atomic<bool> started{false};
+            // the handle parsing on the executor, dropped by whoever claimed the task (a handle keeps the executor
+            // alive, and an executor must not be destroyed by one of its own threads, after the task returns)
+            // the system is still incomplete here, so it's kept behind a pointer
+            std::unique_ptr<System> worker{};
+            WaitGroup finished{};
+        };
+        // tasks started by one parse, their output goes to slots reserved in `res`, and their errors are inserted
+        // into `errors` where they would have been without tasks
+        struct PendingTasks {
+            OutputBuilder& res;
+            std::vector<CompilationError>& errors;
+            Executor* executor = nullptr;
+            std::vector<std::shared_ptr<NestedParse>> tasks{};
+        };
+        // the pending tasks of every parse of this system that is running, outermost first (copies start without any)
+        struct TaskStack {
+            std::vector<PendingTasks*> lists{};
+
+            TaskStack() = default;
+            TaskStack(const TaskStack&) {}
+            TaskStack& operator=(const TaskStack&) { return *this; }
+        } active_tasks{};
+        // called by the outermost loop of the next parse at the start of each top-level statement, with its position,
+        // the size of the output and the number of errors so far, and how far matching the statement before read (the
+        // end of the furthest word any rule looked at), the parse stops before the statement if it returns false (see
+        // `IncrementalParse`), copies of this system start without one
+        using StatementCallback = std::function<bool(const Source::SourcePos&, size_t, size_t, size_t)>;
+        struct StatementHook {
+            const StatementCallback* callback = nullptr;
+
+            StatementHook() = default;
+            StatementHook(const StatementHook&) {}
+            StatementHook& operator=(const StatementHook&) { return *this; }
+        } statement_hook{};
+        // handles (see `handle`) use the grammar they were made with, and copy extensions from `extension_prototypes`
+        // the first time they are used
+        bool is_handle = false;
+        std::shared_ptr<const std::unordered_map<std::string, ExtensionContainer>> extension_prototypes{};
+        // set by `follow`, `live_version` is the version `grammar` was loaded at
+        std::shared_ptr<const LiveGrammar> live_grammar{};
+        size_t live_version = 0;
+
+        struct DepthGuard {
+            size_t& depth;
+            DepthGuard(size_t& depth) : depth{++depth} {}
+            ~DepthGuard() { --depth; }
+        };
+
+      public:
+        // recompiles `rules` if they changed since the last call, the result is shared by copies of this system
+        const Grammar& compile() {
+            if (live_grammar) {
+                const size_t version = live_grammar->version();
+                if (version != live_version) {
+                    grammar = live_grammar->load();
+                    live_version = version;
+                }
+                return *grammar;
+            }
+            if (is_handle)
+                return *grammar;
+            // unchanged rules are still the ones in `compiled_rules` (even in a copy of this system), so forks don't
+            // hash them again
+            if (grammar && rules.storage() == compiled_rules)
+                return *grammar;
+            if (!grammar || grammar->fingerprint != Grammar::hash(rules))
+                grammar = std::make_shared<const Grammar>(rules);
+            compiled_rules = rules.storage();
+            return *grammar;
+        }
+        // the compiled grammar, to be published to a `LiveGrammar`
+        std::shared_ptr<const Grammar> compiled() {
+            compile();
+            return grammar;
+        }
+
+        // parses with `grammar` (for example one loaded from an image, see `Grammar::from_image`) instead of compiling
+        // `rules`, until `rules` are changed
+        void use_grammar(std::shared_ptr<const Grammar> grammar) {
+            this->grammar = std::move(grammar);
+            compiled_rules = rules.storage();
+        }
+
+        // identifies what the output of a parse depends on besides its input: the compiled grammar and the names and
+        // versions of the extensions, used as part of cache keys
+        uint64_t fingerprint() { return hash_extensions(compile().fingerprint); }
+        // number of calls to extensions that are not pure so far, a parse that made none only depends on its input and
+        // on `fingerprint`
+        size_t num_impure_calls() const { return impure_calls; }
+        // number of calls to extensions that are not pure and can't save their state so far, a parse that made none only
+        // depends on its input, on `fingerprint` and on `save_extension_state`
+        size_t num_unsaved_calls() const { return unsaved_calls; }
+
+        // the state of every extension that can save it (see `Extension::saves_state`), so it can be put back later
+        std::string save_extension_state() const {
+            std::vector<std::pair<std::string_view, const ExtensionContainer*>> found{};
+            for (const auto& [name, extension] : extensions)
+                if (extension.saves_state())
+                    found.emplace_back(name, &extension);
+            // handles copy extensions only when they use them, the rest are still prototypes
+            if (is_handle && extension_prototypes)
+                for (const auto& [name, extension] : *extension_prototypes)
+                    if (extension.saves_state() && extensions.find(name) == extensions.end())
+                        found.emplace_back(name, &extension);
+            std::sort(found.begin(), found.end());
+            // names and states are written with their size in front
+            std::string res{};
+            for (const auto& [name, extension] : found) {
+                const auto state = extension->save_state();
+                res.append(std::to_string(name.size())).append(1, ':').append(name);
+                res.append(std::to_string(state.size())).append(1, ':').append(state);
+            }
+            return res;
+        }
+        // puts back a state returned by `save_extension_state`, returns false if it's malformed
+        bool load_extension_state(const std::string_view state) {
+            size_t at = 0;
+            const auto next = [&](std::string_view& res) {
+                const auto colon = state.find(':', at);
+                if (colon == std::string_view::npos || colon == at)
+                    return false;
+                size_t size = 0;
+                for (size_t i = at; i < colon; i++) {
+                    if (!is_num(state[i]) || size > (state.size() - colon) / 10)
+                        return false;
+                    size = size * 10 + static_cast<size_t>(state[i] - '0');
+                }
+                if (size > state.size() - colon - 1)
+                    return false;
+                res = state.substr(colon + 1, size);
+                at = colon + 1 + size;
+                return true;
+            };
+            while (at < state.size()) {
+                std::string_view name{}, saved{};
+                if (!next(name) || !next(saved))
+                    return false;
+                if (auto* extension = find_extension(std::string{name}))
+                    extension->load_state(std::string{saved});
+            }
+            return true;
+        }
+
+      private:
+        // adds the names and versions of the extensions to `h`
+        uint64_t hash_extensions(uint64_t h) const {
+            std::vector<std::pair<std::string_view, uint64_t>> names{};
+            for (const auto& [name, extension] : extensions) names.emplace_back(name, extension.version());
+            // handles copy extensions only when they use them, the rest are still prototypes
+            if (is_handle && extension_prototypes)
+                for (const auto& [name, extension] : *extension_prototypes)
+                    if (extensions.find(name) == extensions.end())
+                        names.emplace_back(name, extension.version());
+            std::sort(names.begin(), names.end());
+            for (const auto& [name, version] : names) {
+                for (const char c : name) h = (h ^ static_cast<uint8_t>(c)) * 1099511628211ull;
+                for (size_t i = 0; i < 8; i++) h = (h ^ ((version >> (i * 8)) & 0xffu)) * 1099511628211ull;
+            }
+            return h;
+        }
+        // the extension called `name`, or null, handles copy it from the prototypes the first time
+        ExtensionContainer* find_extension(const std::string& name) {
+            auto it = extensions.find(name);
+            if (it == extensions.end() && is_handle && extension_prototypes) {
+                const auto prototype = extension_prototypes->find(name);
+                if (prototype != extension_prototypes->end())
+                    it = extensions.emplace(name, prototype->second).first;
+            }
+            return it != extensions.end() ? &it->second : nullptr;
+        }
+
+      public:
+        // parses with the grammar last published to `live` instead of `rules`, a new one is picked up at the start of
+        // each parse, parses that are running keep the grammar they started with
+        // handles and copies of this system follow `live` as well
+        void follow(std::shared_ptr<const LiveGrammar> live) {
+            live_grammar = std::move(live);
+            live_version = live_grammar->version();
+            grammar = live_grammar->load();
+        }
+
+        // a cheap system to parse with on another thread, at the same time as this one and other handles
+        // it shares the compiled grammar instead of copying the rules (its own `rules` are empty and not used), and
+        // copies an extension only the first time it calls it, from a copy of this system's extensions that is made
+        // once and shared by all handles (it is made again if extensions were added since)
+        System handle() {
+            // in the middle of a parse the handle gets the grammar that parse is using
+            if (parse_depth == 0)
+                compile();
+            if (!is_handle) {
+                bool outdated = !extension_prototypes || extension_prototypes->size() != extensions.size();
+                for (auto it = extensions.begin(); !outdated && it != extensions.end(); ++it)
+                    outdated = extension_prototypes->find(it->first) == extension_prototypes->end();
+                if (outdated)
+                    extension_prototypes = std::make_shared<const std::unordered_map<std::string, ExtensionContainer>>(extensions);
+            }
+            System res{};
+            res.grammar = grammar;
+            res.parallel_rules = parallel_rules;
+            res.parallel_expansions = parallel_expansions;
+            res.executor = executor;
+            res.include_cache = include_cache;
+            res.include_directory = include_directory;
+            res.is_handle = true;
+            res.extension_prototypes = extension_prototypes;
+            res.live_grammar = live_grammar;
+            res.live_version = live_version;
+            return res;
+        }
+
+        // runs the parallel features (`parallel_rules`, `parallel_expansions` and `parse_parallel`) on `executor`,
+        // copies and handles of this system share it
+        // without one they run on a pool of all hardware threads, which is shared by all systems and started when it's
+        // first needed, an `InlineExecutor` makes them run serially on the calling thread
+        void set_executor(std::shared_ptr<Executor> executor) { this->executor = std::move(executor); }
+        Executor& get_executor() {
+            if (!executor)
+                executor = default_executor();
+            return *executor;
+        }
+        static std::shared_ptr<Executor> default_executor() {
+            static const auto pool = std::make_shared<ThreadPool>();
+            return pool;
+        }
+
+        template<typename T, typename... Ts,
+                 std::enable_if_t<std::is_base_of_v<Extension, T> && std::is_constructible_v<T, Ts...>, bool> = true>
+        void add_extension(const std::string& name, Ts&&... args) {
+            extensions[name].emplace<T>(std::forward<T>(args)...);
+            extension_prototypes.reset();
+        }
+
+        // a file read for `$INCLUDE`, `owner` keeps `text` alive (a copy of the file, or a mapping of it)
+        struct FileData {
+            std::shared_ptr<const void> owner{};
+            std::string_view text{};
+            int64_t mtime = 0;
+        };
+        // reads the files included with `$INCLUDE`, the default one copies them into memory, `mgm::MappedFileReader` (in
+        // mpt_io.hpp) maps them instead
+        struct FileReader {
+            // modification time of the file at `path`, or nothing if there is no such file
+            virtual std::optional<int64_t> mtime(const std::string& path) = 0;
+            virtual Result<FileData> read(const std::string& path) = 0;
+
+            virtual ~FileReader() = default;
+        };
+        struct StreamFileReader : public FileReader {
+            std::optional<int64_t> mtime(const std::string& path) override {
+                std::error_code error{};
+                const auto time = std::filesystem::last_write_time(path, error);
+                if (error)
+                    return std::nullopt;
+                return static_cast<int64_t>(time.time_since_epoch().count());
+            }
+            Result<FileData> read(const std::string& path) override {
+                // the time is taken first, so a file that changes while it's read is read again next time
+                const auto time = mtime(path);
+                std::ifstream file{path, std::ios::binary};
+                if (!time || !file)
+                    return Error{-1, "Can't read " + path};
+                auto text =
+                    std::make_shared<std::string>(std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{});
+                if (file.bad())
+                    return Error{-1, "Can't read " + path};
+                FileData res{};
+                res.text = *text;
+                res.owner = std::move(text);
+                res.mtime = *time;
+                return res;
+            }
+        };
+
+        // the files included with `$INCLUDE` and their output, shared by copies and handles of a system (and by other
+        // systems given the same cache, see `set_include_cache`), and safe to use from several threads
+        // a file is read again once its modification time changes, its output is reused by systems with the same grammar
+        // and extensions as long as none of the files it included changed either
+        class IncludeCache {
+          public:
+            struct Dependency {
+                std::string path{};
+                int64_t mtime = 0;
+            };
+
+          private:
+            struct Output {
+                uint64_t fingerprint = 0;
+                std::string text{};
+                // every file included while parsing it, directly or not
+                std::vector<Dependency> dependencies{};
+            };
+            struct Entry {
+                FileData file{};
+                std::vector<Output> outputs{};
+            };
+
+            std::shared_ptr<FileReader> reader{};
+            std::mutex mutex{};
+            std::unordered_map<std::string, Entry> files{};
+
+          public:
+            std::atomic<size_t> num_reads{0}, num_parses{0}, num_reused{0};
+
+            IncludeCache(std::shared_ptr<FileReader> reader = nullptr)
+                : reader{reader ? std::move(reader) : std::make_shared<StreamFileReader>()} {}
+            IncludeCache(const IncludeCache&) = delete;
+            IncludeCache& operator=(const IncludeCache&) = delete;
+
+            // the file at `path`, it is only read if it changed since the last time
+            Result<FileData> file(const std::string& path) {
+                const auto mtime = reader->mtime(path);
+                if (!mtime)
+                    return Error{-1, "Can't find " + path};
+                {
+                    std::lock_guard lock{mutex};
+                    const auto it = files.find(path);
+                    if (it != files.end() && it->second.file.mtime == *mtime)
+                        return it->second.file;
+                }
+                // read without holding the lock, other threads can use the cache meanwhile
+                auto res = reader->read(path);
+                if (res.is_error())
+                    return res;
+                ++num_reads;
+                std::lock_guard lock{mutex};
+                const auto [it, added] = files.try_emplace(path);
+                if (added || it->second.file.mtime != res.result().mtime) {
+                    it->second.file = std::move(res.result());
+                    it->second.outputs.clear();
+                }
+                return it->second.file;
+            }
+
+            // the output of the file at `path` as it was at `mtime`, parsed by a system with `fingerprint`, if none of
+            // the files it included changed since, those are added to `dependencies`
+            std::optional<std::string> output(const std::string& path, const int64_t mtime, const uint64_t fingerprint,
+                                              std::vector<Dependency>& dependencies) {
+                std::optional<Output> found{};
+                {
+                    std::lock_guard lock{mutex};
+                    const auto it = files.find(path);
+                    if (it == files.end() || it->second.file.mtime != mtime)
+                        return std::nullopt;
+                    for (const auto& output : it->second.outputs)
+                        if (output.fingerprint == fingerprint)
+                            found = output;
+                }
+                if (!found)
+                    return std::nullopt;
+                for (const auto& dependency : found->dependencies)
+                    if (reader->mtime(dependency.path) != dependency.mtime)
+                        return std::nullopt;
+                ++num_reused;
+                dependencies.insert(dependencies.end(), found->dependencies.begin(), found->dependencies.end());
+                return std::move(found->text);
+            }
+            void store(const std::string& path, const int64_t mtime, const uint64_t fingerprint, const std::string& text,
+                       const std::vector<Dependency>& dependencies) {
+                std::lock_guard lock{mutex};
+                const auto it = files.find(path);
+                // the file changed while it was parsed
+                if (it == files.end() || it->second.file.mtime != mtime)
+                    return;
+                auto& outputs = it->second.outputs;
+                const auto output = std::find_if(outputs.begin(), outputs.end(), [fingerprint](const Output& output) {
+                    return output.fingerprint == fingerprint;
+                });
+                if (output != outputs.end())
+                    *output = Output{fingerprint, text, dependencies};
+                else
+                    outputs.emplace_back(Output{fingerprint, text, dependencies});
+            }
+
+            // forgets all files and outputs
+            void clear() {
+                std::lock_guard lock{mutex};
+                files.clear();
+            }
+        };
+
+      private:
+        struct ExpandCountExtension : public Extension {
+            using Extension::Extension;
+            size_t count{};
+            std::unordered_map<std::string, size_t> counts{};
+            System::Result<std::string> operator()(System& system, const System::GenericValueMap& found_words,
+                                                   const std::string& params) override {
+                if (params.empty())
+                    return std::to_string(count++);
+
+                const auto word = get_first_word(params, false);
+                if (word.second == 0)
+                    return Error{-1, "No word to expand"};
+                const auto var = params.substr(word.first, word.second - word.first);
+
+                if (var == "RESET") {
+                    count = 0;
+                    counts.clear();
+                    return std::to_string(count++);
+                }
+
+                const auto it = counts.find(var);
+                if (it == counts.end())
+                    return std::to_string(counts.emplace(var, 0).first->second++);
+                return std::to_string(it->second++);
+            }
+
+            // the counters are all of its state, so parses using it can still be cached
+            bool saves_state() const override { return true; }
+            // `count`, then every named counter as `name value`, sorted by name so equal states save the same
+            std::string save_state() const override {
+                std::vector<std::pair<std::string_view, size_t>> sorted(counts.begin(), counts.end());
+                std::sort(sorted.begin(), sorted.end());
+                std::string res = std::to_string(count);
+                for (const auto& [var, n] : sorted) res.append(1, ' ').append(var).append(1, ' ').append(std::to_string(n));
+                return res;
+            }
+            void load_state(const std::string& state) override {
+                std::vector<std::string> words{};
+                for (size_t at = 0; at < state.size();) {
+                    const size_t end = std::min(state.find(' ', at), state.size());
+                    words.emplace_back(state.substr(at, end - at));
+                    at = end + 1;
+                }
+                const auto number = [](const std::string& word) {
+                    size_t res = 0;
+                    for (const char c : word) res = res * 10 + static_cast<size_t>(c - '0');
+                    return res;
+                };
+                count = words.empty() ? 0 : number(words[0]);
+                counts.clear();
+                for (size_t i = 1; i + 1 < words.size(); i += 2) counts[words[i]] = number(words[i + 1]);
+            }
+        };
+
+        // `$INCLUDE(path)` expands to the output of the file at `path` (relative paths are relative to the file
+        // including it, or to `include_directory`), or with `$INCLUDE($var)` of the file at the path captured in `var`,
+        // quotes around the path are left out
+        // the file is parsed once and its output reused (see `IncludeCache`), including a file that is already being
+        // included is an error
+        struct IncludeExtension : public Extension {
+            // the files being included, innermost last, with the files each of them included so far
+            struct Include {
+                std::string path{};
+                std::vector<IncludeCache::Dependency> dependencies{};
+            };
+            std::vector<Include> stack{};
+            size_t calls = 0;
+
+            IncludeExtension() = default;
+            // copies (like those of handles) start outside of any include
+            IncludeExtension(const IncludeExtension&) : Extension{} {}
+
+            System::Result<std::string> operator()(System& system, const System::GenericValueMap& found_words,
+                                                   const std::string& params) override {
+                ++calls;
+                std::string_view name{params};
+                while (!name.empty() && is_whitespace(name.front())) name.remove_prefix(1);
+                while (!name.empty() && is_whitespace(name.back())) name.remove_suffix(1);
+                if (!name.empty() && name.front() == '$') {
+                    const auto var = found_words.find(std::string{name.substr(1)});
+                    if (var == found_words.end() || var->second.empty())
+                        return Error{-1, "Variable \"" + std::string{name.substr(1)} + "\" has no value(s)"};
+                    name = var->second.front();
+                }
+                if (name.size() >= 2 && name.front() == '"' && name.back() == '"')
+                    name = name.substr(1, name.size() - 2);
+                if (name.empty())
+                    return Error{-1, "No file to include"};
+
+                std::filesystem::path file{name};
+                if (file.is_relative())
+                    file = (stack.empty() ? std::filesystem::path{system.include_directory}
+                                          : std::filesystem::path{stack.back().path}.parent_path()) /
+                           file;
+                const auto path = file.lexically_normal().string();
+                for (size_t i = 0; i < stack.size(); i++) {
+                    if (stack[i].path != path)
+                        continue;
+                    std::string cycle{};
+                    for (; i < stack.size(); i++) cycle += stack[i].path + " -> ";
+                    return Error{-1, "Include cycle: " + cycle + path};
+                }
+
+                auto& cache = system.get_include_cache();
+                const auto loaded = cache.file(path);
+                if (loaded.is_error())
+                    return loaded.error();
+                const auto& data = loaded.result();
+                const auto fingerprint = system.hash_extensions(system.grammar->fingerprint);
+                std::vector<IncludeCache::Dependency> dependencies{{path, data.mtime}};
+                if (auto output = cache.output(path, data.mtime, fingerprint, dependencies)) {
+                    add_dependencies(system, dependencies);
+                    return std::move(*output);
+                }
+
+                // the output is only reused if the only extensions that aren't pure it called were includes
+                const size_t impure_before = system.impure_calls, calls_before = calls;
+                stack.emplace_back(Include{path, std::move(dependencies)});
+                auto res = data.text.empty() ? Result<std::string, std::vector<CompilationError>>{std::string{}}
+                                             : system.parse(Source{std::vector<std::string_view>{data.text}}, true);
+                auto include = std::move(stack.back());
+                stack.pop_back();
+                ++cache.num_parses;
+                if (res.is_error()) {
+                    const auto& error = res.error()[0];
+                    return Error{static_cast<int64_t>(error.code), path + ':' + std::to_string(error.pos.line) + ':' +
+                                                                       std::to_string(error.pos.column) + ": " + error.message};
+                }
+                if (system.impure_calls - impure_before == calls - calls_before)
+                    cache.store(path, data.mtime, fingerprint, res.result(), include.dependencies);
+                add_dependencies(system, include.dependencies);
+                return std::move(res.result());
+            }
+
+            // files included by an include belong to the file including it, those of the input to the system
+            void add_dependencies(System& system, const std::vector<IncludeCache::Dependency>& dependencies) {
+                if (!stack.empty()) {
+                    stack.back().dependencies.insert(stack.back().dependencies.end(), dependencies.begin(),
+                                                     dependencies.end());
+                    return;
+                }
+                for (const auto& dependency : dependencies) {
+                    const auto found = std::find_if(system.included.begin(), system.included.end(), [&](const auto& file) {
+                        return file.path == dependency.path;
+                    });
+                    if (found == system.included.end())
+                        system.included.emplace_back(dependency);
+                }
+            }
+        };
+
+        std::shared_ptr<IncludeCache> include_cache{};
+        std::vector<IncludeCache::Dependency> included{};
+
+      public:
+        void enable_default_extensions() {
+            extensions.clear();
+            extension_prototypes.reset();
+            add_extension<ExpandCountExtension>("EXPAND_COUNT", ExpandCountExtension{});
+            add_extension<IncludeExtension>("INCLUDE", IncludeExtension{});
+            // made now so copies and handles share it
+            get_include_cache();
+        }
+
+        // every file included with `$INCLUDE` (directly or not) by the parses of this system since it was made, or
+        // since the last `clear_included_files`, with its modification time when it was read
+        const std::vector<IncludeCache::Dependency>& included_files() const { return included; }
+        void clear_included_files() { included.clear(); }
+
+        // the files read by `$INCLUDE`, copies and handles of this system share them
+        void set_include_cache(std::shared_ptr<IncludeCache> cache) { include_cache = std::move(cache); }
+        IncludeCache& get_include_cache() {
+            if (!include_cache)
+                include_cache = std::make_shared<IncludeCache>();
+            return *include_cache;
+        }
+        System(const std::vector<Rule>& rules = {}, const std::unordered_map<std::string, ExtensionContainer>& extensions = {})
+            : rules{rules}, extensions{extensions} {}
+        System(const System& other) = default;
+        System(System&& other) = default;
+        System& operator=(const System& other) = default;
+        System& operator=(System&& other) = default;
+
+        // appends the rules written in `text` to `rules`, returns the number of rules added, or the errors (and adds none)
+        // every line is one word, written like in C++: three columns for the optional, repeat and type prefix, then the
+        // text of the word, where `\n`, `\t` and `\\` stand for a new line, a tab and a backslash
+        // rules are separated by empty lines, and lines starting with `#` are comments
+        Result<size_t, std::vector<CompilationError>> load_rules(const std::string_view text) {
+            std::vector<Rule> loaded{};
+            std::vector<CompilationError> errors{};
+            Rule rule{};
+            rule.words.reserve(8);
+            Source::SourcePos rule_pos{};
+            bool rule_failed = false;
+            const auto finish_rule = [&]() {
+                if (!rule.words.empty() && !rule_failed) {
+                    const auto valid = rule.is_valid();
+                    if (valid.is_error()) {
+                        errors.emplace_back(rule_pos, valid.error().message);
+                        errors.back().code = static_cast<size_t>(valid.error().code);
+                    }
+                    else
+                        loaded.emplace_back(std::move(rule));
+                }
+                rule.words.clear();
+                // most rules are short, so they are built without growing
+                rule.words.reserve(8);
+                rule_failed = false;
+            };
+
+            std::string word{};
+            Index line = 1;
+            for (size_t begin = 0; begin < text.size(); line++) {
+                size_t end = text.find('\n', begin);
+                if (end == std::string_view::npos)
+                    end = text.size();
+                auto str = text.substr(begin, end - begin);
+                const Source::SourcePos pos{static_cast<Index>(begin), line, 1};
+                begin = end + 1;
+
+                if (!str.empty() && str.back() == '\r')
+                    str.remove_suffix(1);
+                if (str.find_first_not_of(" \t") == std::string_view::npos) {
+                    finish_rule();
+                    continue;
+                }
+                if (str[0] == '#')
+                    continue;
+                if (rule.words.empty() && !rule_failed)
+                    rule_pos = pos;
+
+                if (str.size() <= 3) {
+                    errors.emplace_back(pos, "Word has no text after its prefix");
+                    rule_failed = true;
+                    continue;
+                }
+                word.assign(str.substr(0, 3));
+                for (size_t i = 3; i < str.size(); i++) {
+                    if (str[i] != '\\' || i + 1 == str.size()) {
+                        word += str[i];
+                        continue;
+                    }
+                    switch (str[++i]) {
+                        case 'n':
+                            word += '\n';
+                            break;
+                        case 't':
+                            word += '\t';
+                            break;
+                        case '\\':
+                            word += '\\';
+                            break;
+                        default:
+                            // other escapes are kept, they mean something to the template (like `\"`)
+                            word += '\\';
+                            word += str[i];
+                            break;
+                    }
+                }
+                Rule::Word parsed{word};
+                if (parsed.empty()) {
+                    errors.emplace_back(pos, "Invalid word prefix \"" + std::string{str.substr(0, 3)} + "\"");
+                    rule_failed = true;
+                    continue;
+                }
+                rule.words.emplace_back(std::move(parsed));
+            }
+            finish_rule();
+
+            if (!errors.empty())
+                return errors;
+            rules.reserve(rules.size() + loaded.size());
+            for (auto& loaded_rule : loaded) rules.emplace_back(std::move(loaded_rule));
+            return loaded.size();
+        }
+
+      private:
+        Result<std::string> expand_generic(const std::string& str, const GenericValueMap& expand_vars) {
+            const auto expr_to_expand = get_first_word(str, true);
+            if (expr_to_expand.second - expr_to_expand.first == 0)
+                return Error{-1, "Expected expression after $"};
+
+            if (str[expr_to_expand.first] == '(') {
+                SmallVector<std::pair<std::string, Rule::Word::Type>, 16> words_in_expr{};
+                SmallVector<std::pair<size_t, size_t>, 16> exprs_to_expand{};
+                size_t max_iterations = (size_t)-1;
+                for (size_t i = expr_to_expand.first + 1; i < expr_to_expand.second - 1; i++) {
+                    if (str[i] == '$') {
+                        ++i;
+                        auto word_to_expand = get_first_word(str.substr(i), true);
+                        word_to_expand = std::pair{word_to_expand.first + i, word_to_expand.second + i};
+                        if (str[word_to_expand.first] == '(') {
                             const auto expand_result = expand_generic(
                                 str.substr(word_to_expand.first, word_to_expand.second - word_to_expand.first), expand_vars);
                             if (expand_result.is_error())
@@ -976,19 +2750,25 @@ namespace mgm {
 
             if (is_alpha(str[expr_to_expand.first])) {
                 const auto var_name = str.substr(expr_to_expand.first, expr_to_expand.second - expr_to_expand.first);
-                const auto ext = extensions.find(var_name);
-                if (ext != extensions.end()) {
+                if (auto* ext = find_extension(var_name)) {
+                    if (!ext->is_pure()) {
+                        ++impure_calls;
+                        if (!ext->saves_state())
+                            ++unsaved_calls;
+                        join_all_tasks();
+                    }
                     auto params_expr = get_first_word(str.substr(expr_to_expand.second), true);
                     params_expr =
                         std::pair{params_expr.first + expr_to_expand.second, params_expr.second + expr_to_expand.second};
                     if (str[params_expr.first] == '(') {
-                        const auto ext_result =
-                            ext->second(*this, expand_vars, str.substr(params_expr.first + 1, params_expr.second - 1));
+                        // the parameters without the parentheses around them
+                        const auto ext_result = (*ext)(
+                            *this, expand_vars, str.substr(params_expr.first + 1, params_expr.second - params_expr.first - 2));
                         if (ext_result.is_error())
                             return ext_result.error();
                         return ext_result.result();
                     }
-                    const auto ext_result = ext->second(*this, expand_vars, "");
+                    const auto ext_result = (*ext)(*this, expand_vars, "");
                     if (ext_result.is_error())
                         return ext_result.error();
                     return ext_result.result();
@@ -1006,67 +2786,573 @@ namespace mgm {
 
       public:
         Result<std::string, std::vector<CompilationError>> parse(Source str, const bool instant_fail = false) {
-            std::string res{};
+            OutputBuilder res{};
             std::vector<CompilationError> errors{};
+            parse(std::move(str), res, errors, instant_fail, nullptr);
+            if (!errors.empty())
+                return errors;
+            return res.str();
+        }
 
-            for (; !str.reached_end(); ++str) {
+        // parses characters [begin, end) of `str` in place, without copying them, error positions are those in `str`
+        Result<std::string, std::vector<CompilationError>> parse(const Source& str, const size_t begin, const size_t end,
+                                                                 const bool instant_fail = false) {
+            return parse(str.region(begin, end), instant_fail);
+        }
+
+        // writes the output of every top-level statement to `sink` as soon as it is done, instead of keeping it all
+        // in memory, and returns the number of bytes written
+        // output stops at the first error, but statements before it have already been written by then
+        Result<size_t, std::vector<CompilationError>> parse(Source str, Sink& sink, const bool instant_fail = false) {
+            OutputBuilder res{};
+            std::vector<CompilationError> errors{};
+            parse(std::move(str), res, errors, instant_fail, &sink);
+            if (errors.empty())
+                res.flush_to(sink);
+            sink.flush();
+            if (!errors.empty())
+                return errors;
+            return res.flushed_size();
+        }
+
+        // appends the output to `output`, which can reference large verbatim pieces of `str` instead of copying them
+        // returns the number of bytes appended
+        Result<size_t, std::vector<CompilationError>> parse(Source str, OutputBuilder& output, const bool instant_fail = false) {
+            const size_t size_before = output.size();
+            std::vector<CompilationError> errors{};
+            parse(std::move(str), output, errors, instant_fail, nullptr);
+            if (!errors.empty())
+                return errors;
+            return output.size() - size_before;
+        }
+
+        // parses input read through `read` (which fills up to `size` bytes of `data` and returns how many it read, 0 at
+        // the end), keeping only a window of it in memory: whenever the window holds complete top-level statements
+        // (see `StatementScanner`) they are parsed, their output is written to `sink` and their input is dropped
+        // error positions are absolute, as if the whole input had been parsed at once
+        // the output of valid input is the same as that of `parse`, but each window is parsed on its own, so on invalid
+        // input rules can't look past the end of a window while recovering from an error, and the errors found can
+        // differ from those `parse` reports (the input is invalid either way)
+        Result<size_t, std::vector<CompilationError>> parse_stream(const std::function<size_t(char* data, size_t size)>& read,
+                                                                   Sink& sink, const bool instant_fail = false,
+                                                                   const size_t block_size = 64 * 1024) {
+            std::string window{};
+            StatementScanner scanner{};
+            Source::SourcePos base{};
+            std::vector<CompilationError> errors{};
+            size_t written = 0;
+            // the whole input is parsed with the same grammar, even if a new one is published in the meantime
+            if (parse_depth == 0)
+                compile();
+            DepthGuard pin{parse_depth};
+
+            for (bool reached_end = false; !reached_end;) {
+                const size_t scanned = window.size();
+                window.resize(scanned + block_size);
+                const size_t read_size = read(window.data() + scanned, block_size);
+                window.resize(scanned + read_size);
+                reached_end = read_size == 0;
+
+                const size_t end = reached_end ? window.size() : scanner.scan(window.data(), scanned, window.size());
+                if (end == 0)
+                    continue;
+
+                OutputBuilder res{};
+                std::vector<CompilationError> chunk_errors{};
+                parse(Source{window.substr(0, end)}, res, chunk_errors, instant_fail, errors.empty() ? &sink : nullptr);
+                if (errors.empty() && chunk_errors.empty())
+                    res.flush_to(sink);
+                written += res.flushed_size();
+
+                for (auto& err : chunk_errors) {
+                    if (err.pos.line == 1)
+                        err.pos.column += base.column - 1;
+                    err.pos.line += base.line - 1;
+                    err.pos.pos += base.pos;
+                    errors.emplace_back(std::move(err));
+                }
                 if (!errors.empty() && instant_fail)
-                    return errors;
+                    break;
+
+                for (size_t i = 0; i < end; i++) {
+                    if (window[i] == '\n') {
+                        ++base.line;
+                        base.column = 1;
+                    }
+                    else
+                        ++base.column;
+                }
+                base.pos += static_cast<Index>(end);
+                window.erase(0, end);
+            }
 
-                while (is_whitespace(*str)) ++str;
+            sink.flush();
+            if (!errors.empty())
+                return errors;
+            return written;
+        }
+        Result<size_t, std::vector<CompilationError>> parse(std::istream& input, Sink& sink, const bool instant_fail = false) {
+            return parse_stream(
+                [&input](char* data, size_t size) {
+                    input.read(data, static_cast<std::streamsize>(size));
+                    return static_cast<size_t>(input.gcount());
+                },
+                sink, instant_fail);
+        }
 
-                if (*str == '"') {
+        // parses the top-level statements of `str` on the executor (see `set_executor`), the output and errors are the
+        // same as those of `parse`
+        // the input is split into pieces of at least `chunk_size` characters after a `;` or a `}` closing its outermost
+        // brace (see `StatementScanner`), so statements have to end with one of those for the pieces to be independent
+        // pieces that call extensions which are not pure (like EXPAND_COUNT) are parsed again afterwards, in order,
+        // on this system, so those extensions see the statements in the same order as with `parse`
+        Result<std::string, std::vector<CompilationError>> parse_parallel(Source str, const bool instant_fail = false,
+                                                                          const size_t chunk_size = 64 * 1024) {
+            auto& executor = get_executor();
+            const auto cuts = split_statements(str, std::max<size_t>(chunk_size, 1));
+            if (executor.concurrency() <= 1 || cuts.size() <= 2)
+                return parse(std::move(str), instant_fail);
+
+            // all pieces are parsed with the same grammar, even if a new one is published in the meantime
+            if (parse_depth == 0)
+                compile();
+            DepthGuard pin{parse_depth};
+            struct Piece {
+                OutputBuilder output{};
+                std::vector<CompilationError> errors{};
+                bool impure = false;
+            };
+            std::vector<Piece> pieces(cuts.size() - 1);
+            // positions (line and column) of the pieces are found in one pass, instead of once per piece
+            std::vector<Source> sources{};
+            sources.reserve(pieces.size());
+            for (size_t i = 0; i < pieces.size(); i++) {
+                str += cuts[i] - str.pos.pos;
+                sources.emplace_back(str.region(cuts[i], cuts[i + 1]));
+            }
+            std::vector<System> workers{};
+            for (size_t i = 0; i < std::min(executor.concurrency(), pieces.size()); i++) workers.emplace_back(pinned_handle());
+            std::atomic<size_t> next_piece{0};
+            bulk_for(executor, workers.size(), [&](const size_t w) {
+                auto& worker = workers[w];
+                for (size_t i = next_piece++; i < pieces.size(); i = next_piece++) {
+                    const size_t impure_before = worker.impure_calls;
+                    worker.parse(sources[i], pieces[i].output, pieces[i].errors, instant_fail, nullptr);
+                    pieces[i].impure = worker.impure_calls != impure_before;
+                }
+            });
+
+            std::vector<CompilationError> errors{};
+            size_t total = 0;
+            for (size_t i = 0; i < pieces.size(); i++) {
+                if (pieces[i].impure) {
+                    pieces[i] = Piece{};
+                    parse(sources[i], pieces[i].output, pieces[i].errors, instant_fail, nullptr);
+                }
+                total += pieces[i].output.size();
+                for (auto& err : pieces[i].errors) errors.emplace_back(std::move(err));
+                if (!errors.empty() && instant_fail)
+                    break;
+            }
+            if (!errors.empty())
+                return errors;
+
+            std::string res{};
+            res.reserve(total);
+            for (const auto& piece : pieces)
+                for (const auto& segment : piece.output.segments()) res.append(segment.data, segment.size);
+            return res;
+        }
+
+        // a text that is parsed once, then again after every edit, but only from the first top-level statement that
+        // reached the edit (its text or the words its rules looked at) until the parse gets to a statement that started
+        // after the edit, the statements from there on keep their output
+        // statements that called extensions which are not pure are parsed again if they come after an edit, starting
+        // from the extension state they had in the last parse, so the output is always the same as parsing the whole
+        // text again
+        // the document keeps parsing with the grammar and extensions `system` had when it was made
+        class IncrementalParse {
+            using ExtensionMap = std::unordered_map<std::string, ExtensionContainer>;
+            struct Statement {
+                Source::SourcePos begin{};
+                // end of the furthest word read while matching it, or of its furthest error
+                size_t reach = 0;
+                std::string output{};
+                std::vector<CompilationError> errors{};
+                bool impure = false;
+                // the extension state after this statement, the same as the one before it unless this one is impure
+                std::shared_ptr<const ExtensionMap> extensions{};
+            };
+            // moves positions after an edit by as much as the edit moved its end
+            struct Shift {
+                Source::SourcePos old_end{}, new_end{};
+
+                size_t operator()(const size_t pos) const { return pos - old_end.pos + new_end.pos; }
+                Source::SourcePos operator()(const Source::SourcePos& pos) const {
+                    return Source::SourcePos{
+                        static_cast<Index>(pos.pos - old_end.pos + new_end.pos),
+                        static_cast<Index>(pos.line - old_end.line + new_end.line),
+                        static_cast<Index>(pos.line == old_end.line ? pos.column - old_end.column + new_end.column
+                                                                    : pos.column)};
+                }
+            };
+
+            // the system is still incomplete here, so it's kept behind a pointer
+            std::unique_ptr<System> worker{};
+            Source source{};
+            std::vector<Statement> statements{};
+            std::shared_ptr<const ExtensionMap> initial_extensions{};
+            size_t reparsed = 0;
+
+            // the position `to` in `text`, found by walking from `pos`
+            static Source::SourcePos advance(Source::SourcePos pos, const std::string_view text, const size_t to) {
+                for (; pos.pos < to; pos.pos++) {
+                    if (text[pos.pos] == '\n') {
+                        ++pos.line;
+                        pos.column = 1;
+                    }
+                    else
+                        ++pos.column;
+                }
+                return pos;
+            }
+
+            // parses from `start` until the end, or until a statement starts at or after `min_stop` where one of
+            // `old[first_old...]` (moved by `shift`) started, whose index is returned (or `old.size()` at the end)
+            size_t run(const Source::SourcePos& start, const std::vector<Statement>& old, size_t first_old,
+                       const size_t min_stop, const Shift& shift) {
+                worker->extensions = statements.empty() ? *initial_extensions : *statements.back().extensions;
+                Source str = source;
+                str.pos = start;
+
+                struct Mark {
+                    Source::SourcePos pos{};
+                    size_t output_size = 0, num_errors = 0, impure_calls = 0;
+                    // the last statement may have read up to the end
+                    size_t reach = std::numeric_limits<size_t>::max();
+                    bool impure = false;
+                    std::shared_ptr<const ExtensionMap> extensions{};
+                };
+                std::vector<Mark> marks{};
+                auto state = statements.empty() ? initial_extensions : statements.back().extensions;
+                // the extension state is kept after every statement that may have changed it
+                const auto finish_statement = [&]() {
+                    if (marks.empty())
+                        return;
+                    auto& mark = marks.back();
+                    mark.impure = worker->impure_calls != mark.impure_calls;
+                    if (mark.impure)
+                        state = std::make_shared<const ExtensionMap>(worker->extensions);
+                    mark.extensions = state;
+                };
+                size_t stopped = old.size();
+                const StatementCallback callback = [&](const Source::SourcePos& pos, const size_t output_size,
+                                                       const size_t num_errors, const size_t reach) {
+                    finish_statement();
+                    if (!marks.empty())
+                        marks.back().reach = reach;
+                    if (pos.pos >= min_stop && first_old < old.size()) {
+                        const auto it = std::lower_bound(old.begin() + first_old, old.end(), pos.pos,
+                                                         [&](const Statement& statement, const size_t pos) {
+                                                             return shift(statement.begin).pos < pos;
+                                                         });
+                        if (it != old.end() && shift(it->begin).pos == pos.pos) {
+                            stopped = static_cast<size_t>(it - old.begin());
+                            return false;
+                        }
+                    }
+                    marks.emplace_back(Mark{pos, output_size, num_errors, worker->impure_calls});
+                    return true;
+                };
+
+                OutputBuilder output{};
+                std::vector<CompilationError> errors{};
+                worker->statement_hook.callback = &callback;
+                worker->parse(std::move(str), output, errors, false, nullptr);
+                worker->statement_hook.callback = nullptr;
+                if (stopped == old.size())
+                    finish_statement();
+
+                const auto text = output.str();
+                for (size_t i = 0; i < marks.size(); i++) {
+                    const size_t output_end = i + 1 < marks.size() ? marks[i + 1].output_size : text.size();
+                    const size_t errors_end = i + 1 < marks.size() ? marks[i + 1].num_errors : errors.size();
+                    Statement statement{marks[i].pos, marks[i].reach,
+                                        text.substr(marks[i].output_size, output_end - marks[i].output_size)};
+                    statement.errors.assign(std::make_move_iterator(errors.begin() + marks[i].num_errors),
+                                            std::make_move_iterator(errors.begin() + errors_end));
+                    // errors in expansions are placed by walking the text from the statement, which can go past its words
+                    for (const auto& error : statement.errors)
+                        statement.reach = std::max<size_t>(statement.reach, error.pos.pos);
+                    statement.impure = marks[i].impure;
+                    statement.extensions = std::move(marks[i].extensions);
+                    statements.emplace_back(std::move(statement));
+                }
+                reparsed += marks.size();
+                return stopped;
+            }
+
+            // parses from `start`, reusing the statements in `old` that start after the edit once the parse gets to one
+            void parse_from(Source::SourcePos start, std::vector<Statement>& old, size_t first_old, size_t min_stop,
+                            const Shift& shift) {
+                reparsed = 0;
+                for (size_t i = run(start, old, first_old, min_stop, shift); i < old.size();) {
+                    // the statements that didn't call extensions which aren't pure are the same as before
+                    for (; i < old.size() && !old[i].impure; i++) {
+                        auto& statement = old[i];
+                        statement.begin = shift(statement.begin);
+                        if (statement.reach != std::numeric_limits<size_t>::max())
+                            statement.reach = shift(statement.reach);
+                        for (auto& error : statement.errors) error.pos = shift(error.pos);
+                        statement.extensions = statements.empty() ? initial_extensions : statements.back().extensions;
+                        statements.emplace_back(std::move(statement));
+                    }
+                    if (i == old.size())
+                        break;
+                    // the others get the extension state they'd have now, and are parsed on their own
+                    start = shift(old[i].begin);
+                    i = run(start, old, i + 1, start.pos + 1, shift);
+                }
+            }
+
+          public:
+            IncrementalParse(System& system, std::string text = "") : worker{std::make_unique<System>(system.pinned_handle())} {
+                // tasks would fill the output out of order
+                worker->parallel_expansions = false;
+                initial_extensions = std::make_shared<const ExtensionMap>(worker->extensions);
+                source = Source{std::move(text)};
+                std::vector<Statement> old{};
+                parse_from(Source::SourcePos{}, old, 0, 0, Shift{});
+            }
+
+            // replaces characters [begin, end) of the text with `replacement`, and parses the statements it touched again
+            void edit(size_t begin, size_t end, const std::string_view replacement) {
+                const auto old_text = text();
+                end = std::min(end, old_text.size());
+                begin = std::min(begin, end);
+
+                // parsed again from the first statement that reached the edit, with its text (up to where the next one
+                // starts) or with the words its rules looked at
+                size_t first = 0;
+                for (; first < statements.size(); first++) {
+                    const size_t end_of_text = first + 1 < statements.size() ? statements[first + 1].begin.pos : old_text.size();
+                    if (std::max(statements[first].reach, end_of_text) >= begin)
+                        break;
+                }
+                const auto start = first == 0 ? Source::SourcePos{} : statements[first].begin;
+                const auto at_begin = advance(start, old_text, begin);
+                Shift shift{advance(at_begin, old_text, end), {}};
+
+                std::string new_text{};
+                new_text.reserve(old_text.size() - (end - begin) + replacement.size());
+                new_text.append(old_text.substr(0, begin)).append(replacement).append(old_text.substr(end));
+                shift.new_end = advance(at_begin, new_text, begin + replacement.size());
+                source = Source{std::move(new_text)};
+
+                std::vector<Statement> old = std::move(statements);
+                statements.clear();
+                statements.insert(statements.end(), std::make_move_iterator(old.begin()),
+                                  std::make_move_iterator(old.begin() + static_cast<std::ptrdiff_t>(first)));
+                // statements starting after the edit are where the parse can continue with the old ones
+                const size_t first_after = static_cast<size_t>(
+                    std::lower_bound(old.begin(), old.end(), end,
+                                     [](const Statement& statement, const size_t pos) { return statement.begin.pos < pos; }) -
+                    old.begin());
+                parse_from(start, old, first_after, shift.new_end.pos, shift);
+            }
+            // replaces the whole text
+            void assign(std::string text) {
+                source = Source{std::move(text)};
+                statements.clear();
+                std::vector<Statement> old{};
+                parse_from(Source::SourcePos{}, old, 0, 0, Shift{});
+            }
+
+            std::string_view text() const { return std::string_view{source.source.data, source.source.size - 2}; }
+            std::string output() const {
+                size_t size = 0;
+                for (const auto& statement : statements) size += statement.output.size();
+                std::string res{};
+                res.reserve(size);
+                for (const auto& statement : statements) res += statement.output;
+                return res;
+            }
+            std::vector<CompilationError> errors() const {
+                std::vector<CompilationError> res{};
+                for (const auto& statement : statements) res.insert(res.end(), statement.errors.begin(), statement.errors.end());
+                return res;
+            }
+            // the same as `parse` of the whole text would return
+            Result<std::string, std::vector<CompilationError>> result() const {
+                auto found = errors();
+                if (!found.empty())
+                    return found;
+                return output();
+            }
+
+            size_t num_statements() const { return statements.size(); }
+            // statements parsed by the last edit
+            size_t num_reparsed() const { return reparsed; }
+        };
+
+      private:
+        // positions where `str` can be split into pieces of whole top-level statements, at least `chunk_size`
+        // characters long (except for the last one), including the start and end of `str`
+        static std::vector<size_t> split_statements(const Source& str, const size_t chunk_size) {
+            const size_t begin = str.pos.pos, end = str.size() - 1;
+            std::vector<size_t> cuts{begin};
+            StatementScanner scanner{};
+            // `data` holds characters [offset, offset + size) of the source
+            const auto scan = [&](const char* data, const size_t offset, const size_t size) {
+                for (size_t from = 0; from < size; from += chunk_size) {
+                    const size_t last_end = scanner.scan(data, from, std::min(size, from + chunk_size));
+                    if (last_end != 0 && offset + last_end < end && offset + last_end - cuts.back() >= chunk_size)
+                        cuts.emplace_back(offset + last_end);
+                }
+            };
+            if (begin < end) {
+                if (!str.source.is_segmented())
+                    scan(str.source.data + begin, begin, end - begin);
+                else
+                    for (const auto& segment : *str.source.segments) {
+                        const size_t from = std::max(begin, segment.begin);
+                        const size_t to = std::min(end, segment.begin + segment.size);
+                        if (from < to)
+                            scan(segment.data + (from - segment.begin), from, to - from);
+                    }
+            }
+            cuts.emplace_back(std::max(begin, end));
+            return cuts;
+        }
+
+        void parse(Source str, OutputBuilder& res, std::vector<CompilationError>& errors, const bool instant_fail,
+                   Sink* sink) {
+            // nested parses (expansions, extensions) reuse the grammar compiled by the outermost call
+            if (parse_depth == 0)
+                compile();
+            const auto current_grammar = grammar;
+            DepthGuard depth_guard{parse_depth};
+
+            const size_t errors_before = errors.size();
+            const auto segmented = str.source.is_segmented() ? str : Source{};
+            parse(std::move(str), *current_grammar, res, errors, instant_fail, sink);
+
+            if (segmented.source.is_segmented())
+                for (size_t i = errors_before; i < errors.size(); i++) {
+                    size_t segment = 0;
+                    errors[i].pos = segmented.locate(errors[i].pos.pos, segment);
+                    errors[i].segment = static_cast<Index>(segment);
+                }
+        }
+
+        // appends the output to `res` and the errors to `errors`, nested parses write straight into the caller's builder
+        // if `sink` is set, the output of each statement is moved to it once the statement is done
+        void parse(Source str, const Grammar& grammar, OutputBuilder& res, std::vector<CompilationError>& errors,
+                   const bool instant_fail, Sink* sink = nullptr) {
+            if (str.size() >= std::numeric_limits<Index>::max()) {
+                errors.emplace_back(str.pos, "Source is too large for the configured index type",
+                                    CompilationError::Severity::SYSTEM_ERROR);
+                return;
+            }
+
+            const auto on_statement = std::exchange(statement_hook.callback, nullptr);
+            PendingTasks pending{res, errors, parallel_expansions ? &get_executor() : nullptr};
+            active_tasks.lists.emplace_back(&pending);
+            struct PendingGuard {
+                std::vector<PendingTasks*>& lists;
+                ~PendingGuard() { lists.pop_back(); }
+            } pending_guard{active_tasks.lists};
+
+            const size_t errors_before = errors.size();
+            std::vector<std::optional<Grammar::MatchResult>> rule_matches{};
+            // end of the furthest word the rules matched at the current statement read, for `on_statement`
+            size_t reach = 0;
+            for (; !str.reached_end(); ++str) {
+                if (errors.size() != errors_before && instant_fail)
+                    return;
+                if (sink && errors.empty())
+                    res.flush_to(*sink);
+
+                // read through a const reference, a non-const access would make the source unique (and copy it)
+                while (is_whitespace(*std::as_const(str))) ++str;
+                // trailing whitespace is not a statement
+                if (str.reached_end())
+                    break;
+                if (on_statement) {
+                    if (!(*on_statement)(str.pos, res.size(), errors.size(), reach))
+                        break;
+                    reach = str.pos.pos;
+                }
+
+                if (*std::as_const(str) == '"') {
                     const auto word = get_first_word(str, true);
-                    res += str.source.substr(word.first + 1, word.second - word.first - 2);
+                    if (word.second - word.first >= 2) {
+                        const size_t len = word.second - word.first - 2;
+                        if (const char* text = str.source.contiguous(word.first + 1, len))
+                            res.append_ref(text, len, str.source.buffer);
+                        else
+                            res.append(str.source.substr(word.first + 1, len));
+                    }
                     if (word.second > str.pos.pos)
                         str += word.second - str.pos.pos;
                     continue;
                 }
 
-                const Rule* found_rule = nullptr;
-                std::vector<Rule::WordMatch> found_words{};
+                size_t found_rule = 0;
+                Rule::WordMatches found_words{};
                 float best_match_score = 0.0f;
                 CompilationError rule_match_error{0, ""};
 
-                for (const auto& rule : rules) {
-                    const auto _found_words = rule.match(str);
-                    float match_score = 0.0f;
-                    std::vector<Rule::WordMatch> _found_words_result{};
-                    if (_found_words.is_error())
-                        _found_words_result = _found_words.error().first;
-                    else
-                        _found_words_result = _found_words.result();
+                // returns true once no later rule can match better
+                const auto add_match = [&](const size_t rule, const Grammar::MatchResult& _found_words) {
+                    const auto& _found_words_result =
+                        _found_words.is_error() ? _found_words.error().first : _found_words.result();
 
                     if (_found_words_result.empty()) {
                         if (best_match_score == 0.0f && rule_match_error.message.empty())
                             rule_match_error = _found_words.error().second;
-                        continue;
+                        return false;
                     }
 
-                    match_score = float(_found_words_result.back().id + 1) / float(rule.words.size());
-
-                    if (match_score == 1.0f && rule.words[rule.words.size() - 2].type().result() == Rule::Word::Type::DIRECT)
-                        match_score = 2.0f;
-
+                    const float match_score = grammar.score(rule, _found_words_result);
                     if (match_score > best_match_score) {
-                        found_rule = &rule;
+                        found_rule = rule;
                         found_words = _found_words_result;
                         best_match_score = match_score;
                     }
                     if (best_match_score < 1.0f)
                         rule_match_error = _found_words.error().second;
-                    if (best_match_score == 2.0f)
-                        break;
+                    return best_match_score == 2.0f;
+                };
+
+                // in parallel the rules are matched all at once, then looked at in order like below
+                if (parallel_rules && !on_statement && grammar.num_rules() >= min_parallel_rules &&
+                    get_executor().concurrency() > 1) {
+                    match_all_rules(grammar, str, rule_matches);
+                    for (size_t rule = 0; rule < grammar.num_rules(); rule++)
+                        if (add_match(rule, *rule_matches[rule]))
+                            break;
                 }
+                else
+                    for (size_t rule = 0; rule < grammar.num_rules(); rule++)
+                        if (add_match(rule, grammar.match(rule, str, on_statement ? &reach : nullptr)))
+                            break;
 
                 if (best_match_score >= 1.0f) {
+                    const size_t first_word = grammar.rule_offsets[found_rule];
+                    const size_t last_word = grammar.rule_offsets[found_rule + 1] - 1;
                     GenericValueMap expand_vars{};
                     for (const auto& word : found_words)
-                        if (found_rule->words[word.id].type().result() == Rule::Word::Type::GENERIC)
-                            expand_vars[found_rule->words[word.id].word.substr(3)].emplace_back(
-                                str.source.substr(word.match.first, word.match.second - word.match.first));
-
-                    auto expand = found_rule->words.back().word.substr(3);
+                        if (grammar.type(first_word + word.id) == Rule::Word::Type::GENERIC)
+                            expand_vars[grammar.literal_str(first_word + word.id)].emplace_back(
+                                str.source.substr(word.match.first, word.match.second - word.match.first), str,
+                                word.match.first, word.match.second);
+
+                    // the expanded string is assembled once, pieces of the template in between expansions are copied as is
+                    const auto expand = grammar.literal_str(last_word);
+                    OutputBuilder expanded{};
+                    bool expand_failed = false;
+                    size_t copied = 0;
                     for (size_t j = 0; j < expand.size(); j++) {
                         if (expand[j] == '$') {
                             ++j;
@@ -1077,37 +3363,60 @@ namespace mgm {
                                 std::pair{params_expr.first + expand_expr.second, params_expr.second + expand_expr.second};
                             if (expand[params_expr.first] == '(')
                                 expand_expr.second =
-                                    get_first_word(expand.substr(j + expand_expr.second), true).second + j + expand_expr.second;
+                                    get_first_word(expand.substr(params_expr.first), true).second + params_expr.first;
                             const auto expand_result = expand_generic(
                                 expand.substr(expand_expr.first, expand_expr.second - expand_expr.first), expand_vars);
                             if (expand_result.is_error()) {
                                 errors.emplace_back(str.pos, expand_result.error().message);
-                                expand.clear();
+                                expand_failed = true;
                                 break;
                             }
-                            expand = expand.substr(0, j - 1) + expand_result.result() + expand.substr(expand_expr.second);
-                            j = j - 1 + expand_result.result().size();
+                            expanded.append(expand.data() + copied, j - 1 - copied);
+                            expanded.append(expand_result.result());
+                            copied = expand_expr.second;
+                            j = expand_expr.second - 1;
                         }
                     }
-                    if (expand.empty()) {
-                        str += found_words.back().match.second - str.pos.pos;
+                    if (!expand_failed && copied < expand.size())
+                        expanded.append(expand.data() + copied, expand.size() - copied);
+                    // the statement ends at its last word, the expand word (if there is one) has no match in the source
+                    const auto last_word_is_expand = grammar.type(last_word) == Rule::Word::Type::EXPAND ? 2 : 1;
+                    const size_t statement_end = found_words[found_words.size() - last_word_is_expand].match.second;
+                    // what was expanded before a failed expression isn't parsed, it could match the same rule again
+                    if (expand_failed || expanded.empty()) {
+                        if (statement_end > str.pos.pos)
+                            str += statement_end - str.pos.pos;
                         continue;
                     }
-                    const auto parse_result = parse(expand);
-                    if (parse_result.is_error()) {
-                        errors.emplace_back(str.pos,
-                                            "Found " + std::to_string(parse_result.error().size()) +
-                                                " errors while parsing expanded string:",
-                                            CompilationError::Severity::ERROR);
-                        for (const auto& err : parse_result.error())
-                            errors.emplace_back((str + err.pos.pos).pos, err.message, err.severity, err.fix);
+                    if (pending.executor && !instant_fail && expanded.size() >= min_task_size) {
+                        auto task = std::make_shared<NestedParse>();
+                        task->text = Source{expanded.str()};
+                        task->at = str;
+                        task->grammar = &grammar;
+                        task->slot = res.reserve_slot();
+                        task->errors_index = errors.size();
+                        task->worker = std::make_unique<System>(pinned_handle());
+                        task->finished.add();
+                        pending.executor->submit([task]() {
+                            if (task->started.exchange(true))
+                                return;
+                            task->worker->parse(task->text, *task->grammar, task->output, task->errors, false);
+                            task->impure = task->worker->impure_calls != 0;
+                            task->worker.reset();
+                            task->finished.done();
+                        });
+                        pending.tasks.emplace_back(std::move(task));
                     }
-                    else
-                        res += parse_result.result();
-                    const auto last_word_is_expand =
-                        found_rule->words.back().type().result() == Rule::Word::Type::EXPAND ? 2 : 1;
-                    if (found_words[found_words.size() - last_word_is_expand].match.second > str.pos.pos)
-                        str += found_words[found_words.size() - last_word_is_expand].match.second - str.pos.pos;
+                    else {
+                        std::vector<CompilationError> expand_errors{};
+                        parse(expanded.str(), grammar, res, expand_errors, false);
+                        if (!expand_errors.empty()) {
+                            const auto found = expansion_errors(str, expand_errors);
+                            errors.insert(errors.end(), found.begin(), found.end());
+                        }
+                    }
+                    if (statement_end > str.pos.pos)
+                        str += statement_end - str.pos.pos;
                     continue;
                 }
 
@@ -1123,11 +3432,86 @@ namespace mgm {
                 }
             }
 
-            if (!errors.empty())
-                return errors;
+            join_tasks(pending);
+        }
+
+        // a handle that keeps the grammar this system is using (it doesn't follow a `LiveGrammar`), for work that is
+        // part of a running parse
+        System pinned_handle() {
+            auto res = handle();
+            res.live_grammar = nullptr;
+            return res;
+        }
+
+        // matches every rule at `str` on the executor, `results[rule]` is left empty for rules after the first one with a
+        // score of 2 (which are never looked at)
+        void match_all_rules(const Grammar& grammar, const Source& str,
+                             std::vector<std::optional<Grammar::MatchResult>>& results) {
+            results.clear();
+            results.resize(grammar.num_rules());
+            // lowest rule with a score of 2, rules after it don't need to be matched
+            std::atomic<size_t> first_best{std::numeric_limits<size_t>::max()};
+            bulk_for(get_executor(), grammar.num_rules(), [&](const size_t rule) {
+                if (rule > first_best.load(std::memory_order_relaxed))
+                    return;
+                auto& res = results[rule];
+                res.emplace(grammar.match(rule, str));
+                if (grammar.score(rule, res->is_error() ? res->error().first : res->result()) == 2.0f) {
+                    size_t best = first_best.load(std::memory_order_relaxed);
+                    while (rule < best && !first_best.compare_exchange_weak(best, rule)) {}
+                }
+            });
+        }
+
+        // errors found while parsing the expansion of the statement at `at`, as reported to the caller
+        static std::vector<CompilationError> expansion_errors(const Source& at,
+                                                             const std::vector<CompilationError>& expand_errors) {
+            std::vector<CompilationError> res{};
+            res.emplace_back(at.pos, "Found " + std::to_string(expand_errors.size()) + " errors while parsing expanded string:",
+                             CompilationError::Severity::ERROR);
+            for (const auto& err : expand_errors) res.emplace_back((at + err.pos.pos).pos, err.message, err.severity, err.fix);
             return res;
         }
 
+        // waits for the tasks of `list` in order and puts their output and errors in place
+        void join_tasks(PendingTasks& list) {
+            // taken out first, a parse started from here (below) must not join the tasks after the current one
+            auto tasks = std::move(list.tasks);
+            list.tasks.clear();
+            size_t inserted = 0;
+            for (auto& task : tasks) {
+                // no thread got to it yet (they may all be waiting on tasks like this one, if the executor can't run its
+                // queue from `run_pending`), so it's parsed here, in order like without tasks
+                if (!task->started.exchange(true)) {
+                    task->worker.reset();
+                    parse(task->text, *task->grammar, task->output, task->errors, false);
+                }
+                else {
+                    task->finished.wait(*list.executor);
+                    // parsed again here, so extensions that are not pure see the same calls in the same order
+                    if (task->impure) {
+                        task->output = OutputBuilder{};
+                        task->errors.clear();
+                        parse(task->text, *task->grammar, task->output, task->errors, false);
+                    }
+                }
+                list.res.fill_slot(task->slot, std::move(task->output));
+                if (!task->errors.empty()) {
+                    const auto found = expansion_errors(task->at, task->errors);
+                    list.errors.insert(list.errors.begin() + static_cast<ptrdiff_t>(task->errors_index + inserted),
+                                       found.begin(), found.end());
+                    inserted += found.size();
+                }
+            }
+        }
+        void join_all_tasks() {
+            for (size_t i = 0; i < active_tasks.lists.size(); i++) join_tasks(*active_tasks.lists[i]);
+        }
+
+      public:
         ~System() = default;
     };
+
+    inline System::Source::Source(const GenericValue& value)
+        : Source{value.has_origin() ? value.origin.region(value.begin, value.end) : Source{static_cast<const std::string&>(value)}} {}
 } // namespace mgm
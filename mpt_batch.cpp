@@ -0,0 +1,318 @@
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include "mpt.hpp"
+#include "mpt_io.hpp"
+#include "shader_grammar.hpp"
+
+
+// batch driver: parses many files on several threads and writes the output of each one next to it (or under an
+// output directory), files whose output didn't change are not written again
+//   mpt_batch [-r rule file] [-j threads] [-o output directory] [-e input extension] [-x output extension]
+//             [-c cache directory] [-s cache size in MiB] [-m manifest] [-d] <file or directory>...
+// with a manifest, inputs whose output is up to date (see `mgm::BuildManifest`) are skipped, and -d writes a depfile
+// next to every output
+// without a rule file the example shader grammar is used
+// directories are searched recursively for files with the input extension (.mmd by default)
+
+namespace fs = std::filesystem;
+
+namespace {
+    struct Options {
+        size_t num_threads = std::max(1u, std::thread::hardware_concurrency());
+        std::optional<fs::path> output_directory{};
+        std::optional<std::string> rule_file{};
+        std::optional<std::string> cache_directory{};
+        uint64_t cache_size = 1024;
+        std::optional<std::string> manifest{};
+        bool depfiles = false;
+        std::string input_extension = ".mmd";
+        std::string output_extension = ".out";
+        std::vector<fs::path> inputs{};
+    };
+
+    struct Job {
+        fs::path input{}, output{};
+        std::string text{};
+        bool read_failed = false;
+        // the output was made from the same files before, see `mgm::BuildManifest`
+        bool up_to_date = false;
+        // modification time of the input before it was read
+        int64_t mtime = 0;
+        double read_us = 0.0;
+    };
+
+    // jobs read ahead of the workers by the prefetch thread, at most `capacity` at a time
+    class JobQueue {
+        std::mutex mutex{};
+        std::condition_variable changed{};
+        std::deque<Job> jobs{};
+        size_t capacity = 0;
+        bool closed = false;
+
+      public:
+        JobQueue(const size_t capacity) : capacity{capacity} {}
+
+        void push(Job&& job) {
+            std::unique_lock lock{mutex};
+            changed.wait(lock, [&]() { return jobs.size() < capacity; });
+            jobs.emplace_back(std::move(job));
+            changed.notify_all();
+        }
+        void close() {
+            std::lock_guard lock{mutex};
+            closed = true;
+            changed.notify_all();
+        }
+        // returns false once the queue is closed and empty
+        bool pop(Job& job) {
+            std::unique_lock lock{mutex};
+            changed.wait(lock, [&]() { return closed || !jobs.empty(); });
+            if (jobs.empty())
+                return false;
+            job = std::move(jobs.front());
+            jobs.pop_front();
+            changed.notify_all();
+            return true;
+        }
+    };
+
+    // true if `path` already holds exactly `content`
+    bool is_unchanged(const fs::path& path, const std::string& content) {
+        std::error_code error{};
+        if (fs::file_size(path, error) != content.size() || error)
+            return false;
+        std::string old{};
+        return mgm::read_file(path.string(), old) == 0 && old == content;
+    }
+
+    // the files to parse and where their output goes
+    std::vector<std::pair<fs::path, fs::path>> collect(const Options& options) {
+        std::vector<std::pair<fs::path, fs::path>> res{};
+        const auto add = [&](const fs::path& input, const fs::path& relative) {
+            auto output = options.output_directory ? *options.output_directory / relative : input;
+            output.replace_extension(options.output_extension);
+            res.emplace_back(input, output);
+        };
+        for (const auto& input : options.inputs) {
+            std::error_code error{};
+            if (!fs::is_directory(input, error)) {
+                add(input, input.filename());
+                continue;
+            }
+            for (const auto& entry : fs::recursive_directory_iterator{input, error})
+                if (entry.is_regular_file() && entry.path().extension() == options.input_extension)
+                    add(entry.path(), entry.path().lexically_relative(input));
+            if (error)
+                std::cerr << input.string() << ": " << error.message() << std::endl;
+        }
+        return res;
+    }
+
+    bool parse_options(const int argc, char** argv, Options& options) {
+        for (int i = 1; i < argc; i++) {
+            const std::string arg = argv[i];
+            const bool has_value = i + 1 < argc;
+            if (arg == "-r" && has_value)
+                options.rule_file = argv[++i];
+            else if (arg == "-j" && has_value)
+                options.num_threads = std::max<size_t>(1, std::stoul(argv[++i]));
+            else if (arg == "-o" && has_value)
+                options.output_directory = argv[++i];
+            else if (arg == "-e" && has_value)
+                options.input_extension = argv[++i];
+            else if (arg == "-c" && has_value)
+                options.cache_directory = argv[++i];
+            else if (arg == "-s" && has_value)
+                options.cache_size = std::stoull(argv[++i]);
+            else if (arg == "-x" && has_value)
+                options.output_extension = argv[++i];
+            else if (arg == "-m" && has_value)
+                options.manifest = argv[++i];
+            else if (arg == "-d")
+                options.depfiles = true;
+            else if (!arg.empty() && arg[0] == '-')
+                return false;
+            else
+                options.inputs.emplace_back(arg);
+        }
+        return !options.inputs.empty();
+    }
+} // namespace
+
+int main(int argc, char** argv) {
+    Options options{};
+    if (!parse_options(argc, argv, options)) {
+        std::cerr << "usage: " << argv[0]
+                  << " [-r rule file] [-j threads] [-o output directory] [-e input extension] [-x output extension]"
+                     " [-c cache directory] [-s cache size in MiB] [-m manifest] [-d] <file or directory>..."
+                  << std::endl;
+        return 1;
+    }
+
+    mgm::System mp{};
+    if (!options.rule_file)
+        add_shader_grammar(mp);
+    else {
+        add_shader_extensions(mp);
+        const auto loaded = mgm::load_grammar_file(mp, *options.rule_file);
+        if (loaded.is_error()) {
+            for (const auto& err : loaded.error())
+                std::cerr << *options.rule_file << ':' << err.pos.line << ": " << err.message << std::endl;
+            return 1;
+        }
+    }
+    mp.compile();
+    // files included with $INCLUDE are mapped, and read and parsed once for all workers
+    mp.set_include_cache(std::make_shared<mgm::System::IncludeCache>(std::make_shared<mgm::MappedFileReader>()));
+
+    // parses of unchanged inputs are taken from the cache, see `mgm::OutputCache`
+    std::unique_ptr<mgm::OutputCache> cache{};
+    if (options.cache_directory)
+        cache = std::make_unique<mgm::OutputCache>(*options.cache_directory, options.cache_size * 1024 * 1024);
+    std::unique_ptr<mgm::BuildManifest> manifest{};
+    if (options.manifest)
+        manifest = std::make_unique<mgm::BuildManifest>(*options.manifest, mp.fingerprint());
+
+    const auto files = collect(options);
+    const auto begin = std::chrono::steady_clock::now();
+
+    // reads the inputs ahead of the workers, so they don't wait for the disk
+    JobQueue queue{options.num_threads * 2};
+    std::thread prefetch{[&]() {
+        for (const auto& [input, output] : files) {
+            Job job{input, output};
+            // up to date inputs aren't read at all
+            if (manifest && manifest->is_up_to_date(input.string(), output.string())) {
+                job.up_to_date = true;
+                queue.push(std::move(job));
+                continue;
+            }
+            const auto read_begin = std::chrono::steady_clock::now();
+            struct stat info{};
+            if (::stat(input.c_str(), &info) == 0)
+                job.mtime = mgm::modification_time(info);
+            job.read_failed = mgm::read_file(input.string(), job.text) != 0;
+            job.read_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - read_begin).count();
+            queue.push(std::move(job));
+        }
+        queue.close();
+    }};
+
+    std::mutex report_mutex{};
+    size_t num_written = 0, num_unchanged = 0, num_skipped = 0, num_failed = 0;
+    const auto report = [&](const Job& job, const double parse_us, const char* status, const std::string& errors) {
+        std::lock_guard lock{report_mutex};
+        std::cout << std::fixed << std::setprecision(3) << std::setw(10) << job.read_us / 1000.0 << " ms read "
+                  << std::setw(10) << parse_us / 1000.0 << " ms parse  " << std::setw(9) << std::left << status
+                  << std::right << ' ' << job.input.string() << '\n';
+        std::cerr << errors;
+    };
+
+    std::vector<std::thread> workers{};
+    for (size_t i = 0; i < options.num_threads; i++)
+        // one handle per worker, made on this thread
+        workers.emplace_back([&, handle = mp.handle()]() {
+            for (Job job{}; queue.pop(job);) {
+                if (job.up_to_date) {
+                    report(job, 0.0, "skipped", "");
+                    std::lock_guard lock{report_mutex};
+                    ++num_skipped;
+                    continue;
+                }
+                if (job.read_failed) {
+                    report(job, 0.0, "unread", job.input.string() + ": can't read the file\n");
+                    std::lock_guard lock{report_mutex};
+                    ++num_failed;
+                    continue;
+                }
+                // a copy of the untouched handle starts without extension state, like a new process
+                auto system = handle;
+                system.include_directory = job.input.parent_path().string();
+                // the input as it was parsed, `job.text` is moved into the parse
+                const mgm::BuildManifest::FileState input_state{
+                    job.input.string(), job.text.size(), job.mtime, manifest ? mgm::BuildManifest::hash(job.text) : 0};
+                const auto parse_begin = std::chrono::steady_clock::now();
+                const auto res = cache ? cache->parse(system, std::move(job.text)) : system.parse(std::move(job.text));
+                const double parse_us =
+                    std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - parse_begin).count();
+
+                if (res.is_error()) {
+                    std::string errors{};
+                    for (const auto& err : res.error())
+                        errors += job.input.string() + ':' + std::to_string(err.pos.line) + ':' +
+                                  std::to_string(err.pos.column) + ": " + err.message + '\n';
+                    report(job, parse_us, "failed", errors);
+                    if (manifest)
+                        manifest->forget(job.input.string());
+                    std::lock_guard lock{report_mutex};
+                    ++num_failed;
+                    continue;
+                }
+
+                // the files the output was made from besides the input
+                std::vector<std::string> dependencies{};
+                for (const auto& file : system.included_files()) dependencies.emplace_back(file.path);
+                if (options.rule_file)
+                    dependencies.emplace_back(*options.rule_file);
+                const auto finish = [&](const char* status, std::string errors, size_t& count) {
+                    if (options.depfiles) {
+                        auto all = dependencies;
+                        all.insert(all.begin(), job.input.string());
+                        if (const int error = mgm::write_depfile(job.output.string() + ".d", job.output.string(), all);
+                            error != 0)
+                            errors += job.output.string() + ".d: " + std::strerror(error) + '\n';
+                    }
+                    if (manifest && errors.empty())
+                        manifest->record(job.input.string(), job.output.string(), input_state, dependencies);
+                    report(job, parse_us, errors.empty() ? status : "unwritten", errors);
+                    std::lock_guard lock{report_mutex};
+                    ++(errors.empty() ? count : num_failed);
+                };
+                if (is_unchanged(job.output, res.result())) {
+                    finish("unchanged", "", num_unchanged);
+                    continue;
+                }
+
+                std::error_code error{};
+                if (job.output.has_parent_path())
+                    fs::create_directories(job.output.parent_path(), error);
+                // written to a temp file next to the output, then renamed over it
+                const int write_error = mgm::replace_file(job.output.string(), res.result());
+                finish("written", write_error == 0 ? "" : job.output.string() + ": " + std::strerror(write_error) + '\n',
+                       num_written);
+            }
+        });
+    for (auto& worker : workers) worker.join();
+    prefetch.join();
+
+    const double total_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+    std::cout << files.size() << " files in " << std::fixed << std::setprecision(3) << total_ms << " ms on "
+              << options.num_threads << " threads: " << num_written << " written, " << num_unchanged << " unchanged, "
+              << num_skipped << " skipped, " << num_failed << " failed" << std::endl;
+    const auto& includes = mp.get_include_cache();
+    if (includes.num_reads != 0)
+        std::cout << "includes: " << includes.num_reads << " read, " << includes.num_parses << " parsed, "
+                  << includes.num_reused << " reused" << std::endl;
+    if (cache)
+        std::cout << "cache: " << cache->num_hits() << " hits, " << cache->num_misses() << " misses ("
+                  << cache->num_uncacheable() << " not cacheable)" << std::endl;
+    if (manifest)
+        if (const int error = manifest->save(); error != 0) {
+            std::cerr << *options.manifest << ": " << std::strerror(error) << std::endl;
+            return 1;
+        }
+    return num_failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,147 @@
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "mpt_io.hpp"
+
+
+// client for mptd
+//   mpt_client <socket> [file...]                         parses each file (stdin if none) and prints the output
+//   mpt_client <socket> --bench <file> [clients] [requests]  sends `requests` parses of `file` from each of `clients`
+//                                                         connections at the same time and prints the latency distribution
+
+namespace {
+    int connect_to(const std::string& path) {
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path))
+            return -1;
+        path.copy(addr.sun_path, path.size());
+        const int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+            ::close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    bool read_input(const std::string& path, std::string& res) {
+        std::stringstream buffer{};
+        if (path == "-")
+            buffer << std::cin.rdbuf();
+        else {
+            std::ifstream file{path, std::ios::binary};
+            if (!file)
+                return false;
+            buffer << file.rdbuf();
+        }
+        res = buffer.str();
+        return true;
+    }
+
+    // sends one request and waits for the reply, returns false if the connection failed
+    bool request(const int fd, const std::string& input, char& type, std::string& reply) {
+        return mgm::write_frame(fd, 'P', input) == 0 && mgm::read_frame(fd, type, reply) == 0;
+    }
+
+    int bench(const std::string& socket_path, const std::string& input, const size_t num_clients, const size_t num_requests) {
+        std::vector<std::vector<double>> latencies(num_clients);
+        std::vector<std::thread> clients{};
+        const auto begin = std::chrono::steady_clock::now();
+        for (size_t c = 0; c < num_clients; c++)
+            clients.emplace_back([&, c]() {
+                const int fd = connect_to(socket_path);
+                if (fd < 0)
+                    return;
+                char type = 0;
+                std::string reply{};
+                for (size_t i = 0; i < num_requests; i++) {
+                    const auto sent = std::chrono::steady_clock::now();
+                    if (!request(fd, input, type, reply))
+                        break;
+                    latencies[c].emplace_back(
+                        std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - sent).count());
+                }
+                ::close(fd);
+            });
+        for (auto& client : clients) client.join();
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+        std::vector<double> all{};
+        for (const auto& client : latencies) all.insert(all.end(), client.begin(), client.end());
+        if (all.empty()) {
+            std::cerr << "no request succeeded" << std::endl;
+            return 1;
+        }
+        std::sort(all.begin(), all.end());
+        const auto percentile = [&](const double p) { return all[std::min(all.size() - 1, size_t(p * double(all.size())))]; };
+        double sum = 0.0;
+        for (const auto latency : all) sum += latency;
+        std::cout << all.size() << " requests from " << num_clients << " clients, " << double(all.size()) / seconds
+                  << " requests/s\n"
+                  << "latency (us): mean " << sum / double(all.size()) << ", p50 " << percentile(0.5) << ", p90 "
+                  << percentile(0.9) << ", p99 " << percentile(0.99) << ", max " << all.back() << std::endl;
+        return all.size() == num_clients * num_requests ? 0 : 1;
+    }
+} // namespace
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << "usage: " << argv[0] << " <socket> [file...]\n"
+                  << "       " << argv[0] << " <socket> --bench <file> [clients] [requests]" << std::endl;
+        return 1;
+    }
+    const std::string socket_path = argv[1];
+
+    if (argc > 2 && std::string{argv[2]} == "--bench") {
+        std::string input{};
+        if (argc < 4 || !read_input(argv[3], input)) {
+            std::cerr << "can't read the benchmark input" << std::endl;
+            return 1;
+        }
+        return bench(socket_path, input, argc > 4 ? std::stoul(argv[4]) : 4, argc > 5 ? std::stoul(argv[5]) : 1000);
+    }
+
+    const int fd = connect_to(socket_path);
+    if (fd < 0) {
+        std::cerr << "can't connect to " << socket_path << ": " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+    std::vector<std::string> files{};
+    for (int i = 2; i < argc; i++) files.emplace_back(argv[i]);
+    if (files.empty())
+        files.emplace_back("-");
+
+    int res = 0;
+    for (const auto& file : files) {
+        std::string input{}, reply{};
+        char type = 0;
+        if (!read_input(file, input)) {
+            std::cerr << file << ": can't read the file" << std::endl;
+            res = 1;
+            continue;
+        }
+        if (!request(fd, input, type, reply)) {
+            std::cerr << "lost the connection to " << socket_path << std::endl;
+            return 1;
+        }
+        if (type == 'O')
+            std::cout << reply << std::endl;
+        else {
+            // every line of the reply is one error
+            std::istringstream errors{reply};
+            for (std::string line{}; std::getline(errors, line);) std::cerr << file << ':' << line << std::endl;
+            res = 1;
+        }
+    }
+    ::close(fd);
+    return res;
+}
@@ -0,0 +1,51 @@
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#include "mpt.hpp"
+#include "mpt_io.hpp"
+
+
+// compiles a rule file into a grammar image that tools can map instead of loading the rules again
+//   mpt_compile <rule file> <image file>
+// the image is mapped back after writing it and compared to the grammar compiled in memory
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        std::cerr << "usage: " << argv[0] << " <rule file> <image file>" << std::endl;
+        return 1;
+    }
+    const std::string rule_file = argv[1], image_file = argv[2];
+
+    mgm::System mp{};
+    const auto load_begin = std::chrono::steady_clock::now();
+    const auto loaded = mgm::load_rules_file(mp, rule_file);
+    if (loaded.is_error()) {
+        for (const auto& err : loaded.error()) std::cerr << rule_file << ':' << err.pos.line << ": " << err.message << std::endl;
+        return 1;
+    }
+    const auto& grammar = mp.compile();
+    const auto load_end = std::chrono::steady_clock::now();
+
+    if (const int error = mgm::save_grammar_image(grammar, image_file); error != 0) {
+        std::cerr << "can't write " << image_file << ": " << std::strerror(error) << std::endl;
+        return 1;
+    }
+
+    const auto map_begin = std::chrono::steady_clock::now();
+    const auto image = mgm::load_grammar_image(image_file);
+    const auto map_end = std::chrono::steady_clock::now();
+    if (image.is_error()) {
+        std::cerr << image.error().message << std::endl;
+        return 1;
+    }
+    if (*image.result() != grammar) {
+        std::cerr << image_file << ": the image doesn't match the compiled rules" << std::endl;
+        return 1;
+    }
+
+    std::cout << loaded.result() << " rules, " << grammar.to_image().size() << " bytes\n"
+              << "rule file: " << std::chrono::duration<double, std::milli>(load_end - load_begin).count() << " ms, image: "
+              << std::chrono::duration<double, std::milli>(map_end - map_begin).count() << " ms" << std::endl;
+    return 0;
+}
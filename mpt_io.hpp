@@ -0,0 +1,929 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "mpt.hpp"
+
+
+namespace mgm {
+    // writes all of `data` to `fd`, returns 0 or errno of the failed write
+    inline int write_all(const int fd, const char* data, size_t size) {
+        while (size > 0) {
+            const auto written = ::write(fd, data, size);
+            if (written < 0) {
+                if (errno == EINTR)
+                    continue;
+                return errno;
+            }
+            data += written;
+            size -= static_cast<size_t>(written);
+        }
+        return 0;
+    }
+
+    // buffered writer for a file descriptor, so output can go straight to files, pipes or sockets
+    // the descriptor is not owned, and is not closed on destruction
+    class FdSink : public System::Sink {
+        int fd = -1;
+        std::vector<char> buffer{};
+        size_t used = 0;
+        int error = 0;
+
+        // keeps the first error, nothing is written after it
+        void write_out(const char* data, const size_t size) {
+            if (error == 0)
+                error = write_all(fd, data, size);
+        }
+
+      public:
+        FdSink(const int fd, const size_t buffer_size = 64 * 1024) : fd{fd}, buffer(buffer_size) {}
+        FdSink(const FdSink&) = delete;
+        FdSink& operator=(const FdSink&) = delete;
+
+        void write(const char* data, const size_t size) override {
+            if (used + size > buffer.size()) {
+                flush();
+                // writes that would not fit in the buffer anyway skip it
+                if (size >= buffer.size()) {
+                    write_out(data, size);
+                    return;
+                }
+            }
+            memcpy(buffer.data() + used, data, size);
+            used += size;
+        }
+        void flush() override {
+            write_out(buffer.data(), used);
+            used = 0;
+        }
+
+        // errno of the first failed write, or 0
+        int last_error() const { return error; }
+        bool is_error() const { return error != 0; }
+
+        ~FdSink() override { flush(); }
+    };
+
+    // `System::parse_stream` reading from a file descriptor (a pipe, socket or file), the descriptor is not closed
+    // a failed read ends the input like the end of the file does
+    inline System::Result<size_t, std::vector<System::CompilationError>> parse_fd(System& system, const int fd, System::Sink& sink,
+                                                                                  const bool instant_fail = false) {
+        return system.parse_stream(
+            [fd](char* data, size_t size) -> size_t {
+                while (true) {
+                    const auto read = ::read(fd, data, size);
+                    if (read >= 0)
+                        return static_cast<size_t>(read);
+                    if (errno != EINTR)
+                        return 0;
+                }
+            },
+            sink, instant_fail);
+    }
+
+    // writes every segment of `output` with writev, so passthrough text referenced by the output is never copied
+    // returns 0, or errno of the failed write
+    inline int write_output(const int fd, const System::OutputBuilder& output) {
+        const auto& segments = output.segments();
+        std::vector<iovec> iov(std::min(segments.size(), static_cast<size_t>(IOV_MAX)));
+        size_t next = 0;
+        size_t offset = 0; // bytes of `segments[next]` that were already written
+        while (next < segments.size()) {
+            size_t count = 0;
+            for (size_t i = next; i < segments.size() && count < iov.size(); i++, count++) {
+                const size_t skip = i == next ? offset : 0;
+                iov[count].iov_base = const_cast<char*>(segments[i].data + skip);
+                iov[count].iov_len = segments[i].size - skip;
+            }
+            auto written = ::writev(fd, iov.data(), static_cast<int>(count));
+            if (written < 0) {
+                if (errno == EINTR)
+                    continue;
+                return errno;
+            }
+            while (next < segments.size() && static_cast<size_t>(written) >= segments[next].size - offset) {
+                written -= static_cast<ssize_t>(segments[next].size - offset);
+                offset = 0;
+                ++next;
+            }
+            offset += static_cast<size_t>(written);
+        }
+        return 0;
+    }
+
+    // reads the whole file into `res`, returns 0 or errno
+    inline int read_file(const std::string& path, std::string& res) {
+        const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return errno;
+        struct stat info{};
+        if (::fstat(fd, &info) == 0 && info.st_size > 0)
+            res.reserve(res.size() + static_cast<size_t>(info.st_size));
+        int error = 0;
+        char block[64 * 1024];
+        while (error == 0) {
+            const auto read = ::read(fd, block, sizeof(block));
+            if (read == 0)
+                break;
+            if (read < 0) {
+                if (errno != EINTR)
+                    error = errno;
+                continue;
+            }
+            res.append(block, static_cast<size_t>(read));
+        }
+        ::close(fd);
+        return error;
+    }
+
+    // `System::load_rules` for a rule file, a file that can't be read is reported as a single SYSTEM_ERROR
+    inline System::Result<size_t, std::vector<System::CompilationError>> load_rules_file(System& system, const std::string& path) {
+        std::string text{};
+        const int error = read_file(path, text);
+        if (error != 0)
+            return std::vector<System::CompilationError>{System::CompilationError{
+                {}, "Can't read " + path + ": " + std::strerror(error), System::CompilationError::Severity::SYSTEM_ERROR}};
+        return system.load_rules(text);
+    }
+
+    // maps a grammar image (see `System::Grammar::to_image`) into memory, the mapping lives as long as the grammar
+    inline System::Result<std::shared_ptr<const System::Grammar>> load_grammar_image(const std::string& path) {
+        const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return System::Error{errno, "Can't open " + path + ": " + std::strerror(errno)};
+        struct stat info{};
+        if (::fstat(fd, &info) != 0 || info.st_size <= 0) {
+            const int error = errno;
+            ::close(fd);
+            return System::Error{error, "Can't map " + path + ": " + (error != 0 ? std::strerror(error) : "empty file")};
+        }
+        const size_t size = static_cast<size_t>(info.st_size);
+        void* data = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        const int error = errno;
+        ::close(fd);
+        if (data == MAP_FAILED)
+            return System::Error{error, "Can't map " + path + ": " + std::strerror(error)};
+        std::shared_ptr<const void> mapping{data, [size](const void* data) { ::munmap(const_cast<void*>(data), size); }};
+        auto res = System::Grammar::from_image(static_cast<const char*>(data), size, std::move(mapping));
+        if (res.is_error())
+            return System::Error{res.error().code, path + ": " + res.error().message};
+        return res;
+    }
+
+    // modification time of a file in nanoseconds
+    inline int64_t modification_time(const struct stat& info) {
+        return static_cast<int64_t>(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+    }
+
+    // reads files included with `$INCLUDE` by mapping them, so large files shared by many inputs are not copied
+    // use it with `system.set_include_cache(std::make_shared<System::IncludeCache>(std::make_shared<MappedFileReader>()))`
+    struct MappedFileReader : public System::FileReader {
+        std::optional<int64_t> mtime(const std::string& path) override {
+            struct stat info{};
+            if (::stat(path.c_str(), &info) != 0)
+                return std::nullopt;
+            return modification_time(info);
+        }
+        System::Result<System::FileData> read(const std::string& path) override {
+            const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
+                return System::Error{errno, "Can't open " + path + ": " + std::strerror(errno)};
+            struct stat info{};
+            if (::fstat(fd, &info) != 0) {
+                const int error = errno;
+                ::close(fd);
+                return System::Error{error, "Can't read " + path + ": " + std::strerror(error)};
+            }
+            System::FileData res{};
+            res.mtime = modification_time(info);
+            const size_t size = static_cast<size_t>(info.st_size);
+            // empty files can't be mapped, and have no text to keep alive
+            if (size == 0) {
+                ::close(fd);
+                return res;
+            }
+            void* data = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            const int error = errno;
+            ::close(fd);
+            if (data == MAP_FAILED)
+                return System::Error{error, "Can't map " + path + ": " + std::strerror(error)};
+            res.owner =
+                std::shared_ptr<const void>{data, [size](const void* data) { ::munmap(const_cast<void*>(data), size); }};
+            res.text = std::string_view{static_cast<const char*>(data), size};
+            return res;
+        }
+    };
+
+    // framed messages over a stream (a socket or pipe): a one byte type, the payload size as 4 bytes (big endian), then
+    // the payload, used by mptd and its client
+    // writes one frame, returns 0 or errno of the failed write
+    inline int write_frame(const int fd, const char type, const char* data, const size_t size) {
+        if (size > UINT32_MAX)
+            return EMSGSIZE;
+        const unsigned char header[5]{static_cast<unsigned char>(type), static_cast<unsigned char>(size >> 24),
+                                      static_cast<unsigned char>(size >> 16), static_cast<unsigned char>(size >> 8),
+                                      static_cast<unsigned char>(size)};
+        iovec iov[2]{{const_cast<unsigned char*>(header), sizeof(header)}, {const_cast<char*>(data), size}};
+        size_t done = 0;
+        const size_t total = sizeof(header) + size;
+        while (done < total) {
+            // skips what was already written of the header and payload
+            iovec rest[2]{iov[0], iov[1]};
+            int first = 0;
+            if (done < sizeof(header)) {
+                rest[0].iov_base = const_cast<unsigned char*>(header) + done;
+                rest[0].iov_len = sizeof(header) - done;
+            }
+            else {
+                first = 1;
+                rest[1].iov_base = const_cast<char*>(data) + (done - sizeof(header));
+                rest[1].iov_len = total - done;
+            }
+            const auto written = ::writev(fd, rest + first, 2 - first);
+            if (written < 0) {
+                if (errno == EINTR)
+                    continue;
+                return errno;
+            }
+            done += static_cast<size_t>(written);
+        }
+        return 0;
+    }
+    inline int write_frame(const int fd, const char type, const std::string& payload) {
+        return write_frame(fd, type, payload.data(), payload.size());
+    }
+
+    // reads one frame into `type` and `payload`, returns 0, errno of the failed read, EMSGSIZE if the payload is larger
+    // than `max_size`, or -1 if the stream ended (before or in the middle of a frame)
+    inline int read_frame(const int fd, char& type, std::string& payload, const size_t max_size = 1024 * 1024 * 1024) {
+        const auto read_all = [fd](char* data, size_t size) {
+            while (size > 0) {
+                const auto read = ::read(fd, data, size);
+                if (read < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    return errno;
+                }
+                if (read == 0)
+                    return -1;
+                data += read;
+                size -= static_cast<size_t>(read);
+            }
+            return 0;
+        };
+        unsigned char header[5]{};
+        if (const int error = read_all(reinterpret_cast<char*>(header), sizeof(header)); error != 0)
+            return error;
+        const size_t size = (size_t{header[1]} << 24) | (size_t{header[2]} << 16) | (size_t{header[3]} << 8) | header[4];
+        if (size > max_size)
+            return EMSGSIZE;
+        type = static_cast<char>(header[0]);
+        payload.resize(size);
+        return read_all(payload.data(), size);
+    }
+
+    // sink that keeps output in memory up to `memory_budget` bytes and moves everything past that to a temp file,
+    // so huge outputs keep a bounded footprint
+    // the result is finalized with `commit` (rename into place) or `stream_to` (read back in order)
+    class SpillSink : public System::Sink {
+        std::vector<char> memory{};
+        size_t memory_budget = 0;
+        std::string temp_directory{};
+        std::string temp_path{};
+        int temp_fd = -1;
+        size_t spilled_size = 0;
+        int error = 0;
+
+        // creates a temp file from `directory`, returns its descriptor and sets `path`, or -1
+        static int make_temp(const std::string& directory, std::string& path) {
+            path = directory + "/mpt-XXXXXX";
+            return ::mkstemp(path.data());
+        }
+
+        void spill() {
+            if (error != 0 || memory.empty())
+                return;
+            if (temp_fd < 0) {
+                temp_fd = make_temp(temp_directory, temp_path);
+                if (temp_fd < 0) {
+                    error = errno;
+                    return;
+                }
+            }
+            error = write_all(temp_fd, memory.data(), memory.size());
+            spilled_size += memory.size();
+            memory.clear();
+        }
+
+        void remove_temp() {
+            if (temp_fd >= 0) {
+                ::close(temp_fd);
+                ::unlink(temp_path.c_str());
+            }
+            temp_fd = -1;
+            temp_path.clear();
+        }
+
+      public:
+        static std::string default_temp_directory() {
+            const char* dir = std::getenv("TMPDIR");
+            return dir && *dir ? dir : "/tmp";
+        }
+
+        SpillSink(const size_t memory_budget = 64 * 1024 * 1024, std::string temp_directory = default_temp_directory())
+            : memory_budget{memory_budget}, temp_directory{std::move(temp_directory)} {}
+        SpillSink(const SpillSink&) = delete;
+        SpillSink& operator=(const SpillSink&) = delete;
+
+        void write(const char* data, const size_t size) override {
+            if (memory.size() + size > memory_budget) {
+                spill();
+                // pieces larger than the whole budget go straight to the file
+                if (size > memory_budget) {
+                    memory.insert(memory.end(), data, data + size);
+                    spill();
+                    return;
+                }
+            }
+            memory.insert(memory.end(), data, data + size);
+        }
+
+        size_t size() const { return spilled_size + memory.size(); }
+        bool spilled() const { return temp_fd >= 0; }
+        // errno of the first failed file operation, or 0
+        int last_error() const { return error; }
+        bool is_error() const { return error != 0; }
+
+        // moves the output to `path` with permissions `mode`, replacing it atomically, returns 0 or errno
+        // the sink is empty afterwards
+        int commit(const std::string& path, const mode_t mode = 0600) {
+            spill();
+            if (error == 0 && temp_fd < 0) {
+                // nothing was spilled, write an empty file the same way
+                temp_fd = make_temp(temp_directory, temp_path);
+                if (temp_fd < 0)
+                    error = errno;
+            }
+            // set before the rename, so `path` never has the temp file's permissions
+            if (error == 0 && ::fchmod(temp_fd, mode) != 0)
+                error = errno;
+            if (error == 0 && ::fsync(temp_fd) != 0)
+                error = errno;
+            if (error == 0) {
+                if (::rename(temp_path.c_str(), path.c_str()) == 0) {
+                    // the temp name is free again, and another writer's `mkstemp` may already have taken it, so it
+                    // must not be unlinked below
+                    ::close(temp_fd);
+                    temp_fd = -1;
+                    temp_path.clear();
+                }
+                else if (errno != EXDEV)
+                    error = errno;
+                else {
+                    // the temp directory is on another file system, copy next to `path` and rename that
+                    std::string local_path{};
+                    const auto slash = path.find_last_of('/');
+                    const int local_fd = make_temp(slash == std::string::npos ? "." : path.substr(0, slash), local_path);
+                    if (local_fd < 0)
+                        error = errno;
+                    else {
+                        if (::fchmod(local_fd, mode) != 0)
+                            error = errno;
+                        FdSink copy{local_fd};
+                        if (error == 0)
+                            error = stream_to(copy);
+                        copy.flush();
+                        if (error == 0)
+                            error = copy.last_error();
+                        if (error == 0 && ::rename(local_path.c_str(), path.c_str()) != 0)
+                            error = errno;
+                        ::close(local_fd);
+                        if (error != 0)
+                            ::unlink(local_path.c_str());
+                    }
+                }
+            }
+            const int res = error;
+            remove_temp();
+            spilled_size = 0;
+            return res;
+        }
+
+        // writes the whole output to `sink` in order, returns 0 or errno
+        int stream_to(System::Sink& sink) {
+            if (error != 0)
+                return error;
+            if (temp_fd >= 0) {
+                std::vector<char> block(std::min<size_t>(std::max<size_t>(memory_budget, 4096), 1024 * 1024));
+                off_t offset = 0;
+                while (static_cast<size_t>(offset) < spilled_size) {
+                    const auto read = ::pread(temp_fd, block.data(), block.size(), offset);
+                    if (read < 0) {
+                        if (errno == EINTR)
+                            continue;
+                        return error = errno;
+                    }
+                    if (read == 0)
+                        break;
+                    sink.write(block.data(), static_cast<size_t>(read));
+                    offset += read;
+                }
+            }
+            if (!memory.empty())
+                sink.write(memory.data(), memory.size());
+            return 0;
+        }
+
+        ~SpillSink() override { remove_temp(); }
+    };
+
+    // the process's umask, read once (it can only be read by setting it, which would race with files made meanwhile)
+    inline mode_t process_umask() {
+        static const mode_t mask = []() {
+            const mode_t res = ::umask(022);
+            ::umask(res);
+            return res;
+        }();
+        return mask;
+    }
+
+    // writes `data` to `path` through a temp file in the same directory, which replaces it atomically, returns 0 or errno
+    // an existing file keeps its permissions, a new one gets 0644 without the bits in the umask
+    inline int replace_file(const std::string& path, const std::string& data) {
+        struct stat info{};
+        const mode_t mode = ::stat(path.c_str(), &info) == 0 ? info.st_mode & 07777 : 0644 & ~process_umask();
+        const auto slash = path.find_last_of('/');
+        SpillSink sink{data.size(), slash == std::string::npos ? "." : path.substr(0, slash)};
+        sink.write(data.data(), data.size());
+        return sink.commit(path, mode);
+    }
+
+    // writes the image of `grammar` to `path`, replacing it atomically, returns 0 or errno
+    inline int save_grammar_image(const System::Grammar& grammar, const std::string& path) {
+        return replace_file(path, grammar.to_image());
+    }
+
+    // loads the grammar in `path` into `system`: a grammar image (see `load_grammar_image`) is used as it is, anything
+    // else is read as a rule file (see `load_rules_file`)
+    inline System::Result<size_t, std::vector<System::CompilationError>> load_grammar_file(System& system, const std::string& path) {
+        char magic[sizeof(System::Grammar::image_magic)]{};
+        const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        const bool is_image = fd >= 0 && ::read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+                              std::equal(magic, magic + sizeof(magic), System::Grammar::image_magic);
+        if (fd >= 0)
+            ::close(fd);
+        if (!is_image)
+            return load_rules_file(system, path);
+
+        auto grammar = load_grammar_image(path);
+        if (grammar.is_error())
+            return std::vector<System::CompilationError>{
+                System::CompilationError{{}, grammar.error().message, System::CompilationError::Severity::SYSTEM_ERROR}};
+        const size_t num_rules = grammar.result()->num_rules();
+        system.use_grammar(std::move(grammar.result()));
+        return num_rules;
+    }
+
+    // cache of parse results in a directory, keyed by the input and `System::fingerprint`, so unchanged inputs aren't
+    // parsed again by later runs (or other processes using the same directory)
+    // parses that call extensions which are not pure and can't save their state are never stored, and once the cache
+    // grows past `max_size` bytes the least recently used entries are removed
+    class OutputCache {
+      public:
+        using ParseResult = System::Result<std::string, std::vector<System::CompilationError>>;
+
+      private:
+        std::string directory{};
+        uint64_t max_size = 0;
+        std::mutex evict_mutex{};
+        // the first store scans the directory, to find out how large it already is
+        std::atomic<uint64_t> written_since_evict{0};
+        std::atomic<size_t> hits{0}, misses{0}, uncacheable{0};
+
+        // 128 bit fnv-1a taking 8 bytes at a time, wide enough that different inputs never share an entry in practice
+        static std::string key(const uint64_t fingerprint, const bool instant_fail, const std::string& state,
+                               const std::string& input) {
+            using u128 = unsigned __int128;
+            constexpr u128 prime = (u128{1} << 88) + 0x13b;
+            u128 h = (u128{0x6c62272e07bb0142ull} << 64) | 0x62b821756295c58dull;
+            const auto add = [&](const uint64_t block) { h = (h ^ block) * prime; };
+            const auto add_string = [&](const std::string& str) {
+                add(str.size());
+                size_t i = 0;
+                for (; i + 8 <= str.size(); i += 8) {
+                    uint64_t block = 0;
+                    std::memcpy(&block, str.data() + i, 8);
+                    add(block);
+                }
+                for (; i < str.size(); i++) add(static_cast<uint8_t>(str[i]));
+            };
+            add(fingerprint);
+            add(instant_fail);
+            add_string(state);
+            add_string(input);
+
+            // fnv leaves the first digits of similar inputs alike, mixing the halves spreads entries over the folders
+            const auto mix = [](uint64_t k) {
+                k = (k ^ (k >> 33)) * 0xff51afd7ed558ccdull;
+                k = (k ^ (k >> 33)) * 0xc4ceb9fe1a85ec53ull;
+                return k ^ (k >> 33);
+            };
+            uint64_t high = static_cast<uint64_t>(h >> 64), low = static_cast<uint64_t>(h);
+            low ^= mix(high);
+            high ^= mix(low);
+
+            static constexpr char digits[] = "0123456789abcdef";
+            std::string res(32, '0');
+            for (size_t d = 0; d < 16; d++) {
+                res[15 - d] = digits[(high >> (d * 4)) & 0xf];
+                res[31 - d] = digits[(low >> (d * 4)) & 0xf];
+            }
+            return res;
+        }
+        // entries are spread over 256 directories by the first two digits of their key
+        std::string entry_path(const std::string& key) const { return directory + '/' + key.substr(0, 2) + '/' + key.substr(2); }
+
+        // the extension state after the parse (see `System::save_extension_state`), then 'O' and the output, or 'E'
+        // and the errors
+        static std::string serialize(const ParseResult& res, const std::string& state) {
+            std::string data{};
+            const auto add_number = [&](const uint64_t n) { data.append(reinterpret_cast<const char*>(&n), sizeof(n)); };
+            const auto add_string = [&](const std::string& str) {
+                add_number(str.size());
+                data += str;
+            };
+            add_string(state);
+            if (!res.is_error())
+                return data + 'O' + res.result();
+            data += 'E';
+            add_number(res.error().size());
+            for (const auto& err : res.error()) {
+                add_number(static_cast<uint64_t>(err.severity));
+                add_number(err.pos.pos);
+                add_number(err.pos.line);
+                add_number(err.pos.column);
+                add_number(err.segment);
+                add_number(err.code);
+                add_string(err.message);
+                add_string(err.fix);
+            }
+            return data;
+        }
+        static std::optional<std::pair<ParseResult, std::string>> deserialize(const std::string& data) {
+            size_t at = 0;
+            bool valid = true;
+            const auto number = [&]() {
+                uint64_t n = 0;
+                if (data.size() - at < sizeof(n))
+                    valid = false;
+                else
+                    std::memcpy(&n, data.data() + at, sizeof(n));
+                at += valid ? sizeof(n) : 0;
+                return n;
+            };
+            const auto string = [&]() {
+                const uint64_t size = number();
+                if (!valid || data.size() - at < size) {
+                    valid = false;
+                    return std::string{};
+                }
+                at += size;
+                return data.substr(at - size, size);
+            };
+            auto state = string();
+            if (!valid || at == data.size())
+                return std::nullopt;
+            if (data[at] == 'O')
+                return std::pair{ParseResult{data.substr(at + 1)}, std::move(state)};
+            if (data[at++] != 'E')
+                return std::nullopt;
+            std::vector<System::CompilationError> errors(std::min<uint64_t>(number(), data.size()));
+            for (auto& err : errors) {
+                err.severity = static_cast<System::CompilationError::Severity>(number());
+                err.pos.pos = static_cast<System::Index>(number());
+                err.pos.line = static_cast<System::Index>(number());
+                err.pos.column = static_cast<System::Index>(number());
+                err.segment = static_cast<System::Index>(number());
+                err.code = number();
+                err.message = string();
+                err.fix = string();
+            }
+            if (!valid || at != data.size())
+                return std::nullopt;
+            return std::pair{ParseResult{std::move(errors)}, std::move(state)};
+        }
+
+        void store(const std::string& key, const ParseResult& res, const std::string& state) {
+            const auto data = serialize(res, state);
+            const auto path = entry_path(key);
+            const auto folder = path.substr(0, path.find_last_of('/'));
+            std::error_code error{};
+            std::filesystem::create_directories(folder, error);
+            SpillSink sink{data.size(), folder};
+            sink.write(data.data(), data.size());
+            if (sink.commit(path) != 0)
+                return;
+            if ((written_since_evict += data.size()) > max_size / 16) {
+                std::unique_lock lock{evict_mutex, std::try_to_lock};
+                if (lock) {
+                    written_since_evict = 0;
+                    evict_locked();
+                }
+            }
+        }
+
+        uint64_t evict_locked() {
+            struct Entry {
+                std::filesystem::file_time_type used{};
+                uint64_t size = 0;
+                std::filesystem::path path{};
+            };
+            std::vector<Entry> entries{};
+            uint64_t total = 0;
+            std::error_code error{};
+            for (auto it = std::filesystem::recursive_directory_iterator{directory, error};
+                 !error && it != std::filesystem::recursive_directory_iterator{}; it.increment(error)) {
+                // temp files (see `SpillSink`) are entries still being written
+                if (!it->is_regular_file(error) || it->path().filename().string().rfind("mpt-", 0) == 0)
+                    continue;
+                Entry entry{it->last_write_time(error), it->file_size(error), it->path()};
+                if (error)
+                    continue;
+                total += entry.size;
+                entries.emplace_back(std::move(entry));
+            }
+            if (total <= max_size)
+                return 0;
+            // trims to 90%, so the next few stores don't evict again right away
+            std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.used < b.used; });
+            uint64_t removed = 0;
+            for (size_t i = 0; i < entries.size() && total - removed > max_size / 10 * 9; i++)
+                if (std::filesystem::remove(entries[i].path, error))
+                    removed += entries[i].size;
+            return removed;
+        }
+
+      public:
+        OutputCache(std::string directory, const uint64_t max_size = 1024ull * 1024 * 1024)
+            : directory{std::move(directory)}, max_size{max_size}, written_since_evict{max_size} {}
+        OutputCache(const OutputCache&) = delete;
+        OutputCache& operator=(const OutputCache&) = delete;
+
+        // the stored result of parsing `input` with the same grammar and extensions, or the result of parsing it now
+        // extensions that save their state (see `Extension::saves_state`) are part of the key with the state they have
+        // before the parse, and get the state they had after it back with a stored result
+        // safe to call from several threads, each with its own system
+        ParseResult parse(System& system, std::string input, const bool instant_fail = false) {
+            const auto entry_key = key(system.fingerprint(), instant_fail, system.save_extension_state(), input);
+            const auto path = entry_path(entry_key);
+            std::string data{};
+            if (read_file(path, data) == 0)
+                if (auto res = deserialize(data); res && system.load_extension_state(res->second)) {
+                    ++hits;
+                    // marks the entry as recently used
+                    ::utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+                    return std::move(res->first);
+                }
+            ++misses;
+
+            const size_t unsaved_before = system.num_unsaved_calls();
+            auto res = system.parse(std::move(input), instant_fail);
+            if (system.num_unsaved_calls() != unsaved_before)
+                ++uncacheable;
+            else
+                store(entry_key, res, system.save_extension_state());
+            return res;
+        }
+
+        // removes the least recently used entries if the cache is larger than `max_size`, returns the bytes removed
+        uint64_t evict() {
+            std::lock_guard lock{evict_mutex};
+            written_since_evict = 0;
+            return evict_locked();
+        }
+
+        size_t num_hits() const { return hits; }
+        size_t num_misses() const { return misses; }
+        // misses that weren't stored because they called extensions which are not pure and can't save their state
+        size_t num_uncacheable() const { return uncacheable; }
+    };
+
+    // writes a depfile (`target: dependency...`, the format Make and Ninja read) to `path`, returns 0 or errno
+    // a depfile that already lists the same files is left alone
+    inline int write_depfile(const std::string& path, const std::string& target, const std::vector<std::string>& dependencies) {
+        // spaces and `#` are escaped with a backslash, `$` is doubled
+        const auto escape = [](const std::string& name) {
+            std::string res{};
+            for (const char c : name) {
+                if (c == ' ' || c == '#')
+                    res += '\\';
+                else if (c == '$')
+                    res += '$';
+                res += c;
+            }
+            return res;
+        };
+        std::string text = escape(target) + ':';
+        for (const auto& dependency : dependencies) text += " \\\n  " + escape(dependency);
+        text += '\n';
+
+        std::string old{};
+        if (read_file(path, old) == 0 && old == text)
+            return 0;
+        return replace_file(path, text);
+    }
+
+    // what each output of a batch was made from: the `System::fingerprint` of the system, and the size, modification
+    // time and hash of every file the output depended on (its input, the files it included and the grammar file), so
+    // inputs whose output is up to date don't have to be parsed again
+    // files whose size and time didn't change are taken as unchanged, the others are hashed, so touching a file doesn't
+    // make outputs out of date
+    // safe to use from several threads, changes are written to the manifest file by `save`
+    class BuildManifest {
+      public:
+        struct FileState {
+            std::string path{};
+            uint64_t size = 0;
+            int64_t mtime = 0;
+            uint64_t hash = 0;
+        };
+
+      private:
+        struct Entry {
+            std::string output{};
+            std::vector<FileState> dependencies{};
+        };
+        // a file as it is on disk now, each file is looked at (and hashed) at most once
+        struct DiskState {
+            bool exists = false;
+            uint64_t size = 0;
+            int64_t mtime = 0;
+            std::optional<uint64_t> hash{};
+        };
+
+        static constexpr std::string_view header = "mpt manifest 1 ";
+
+        std::string path{};
+        uint64_t fingerprint = 0;
+        std::mutex mutex{};
+        std::unordered_map<std::string, Entry> entries{};
+        std::unordered_map<std::string, DiskState> disk{};
+
+        DiskState& look_at(const std::string& file) {
+            const auto [it, added] = disk.try_emplace(file);
+            struct stat info{};
+            if (added && ::stat(file.c_str(), &info) == 0) {
+                it->second.exists = true;
+                it->second.size = static_cast<uint64_t>(info.st_size);
+                it->second.mtime = modification_time(info);
+            }
+            return it->second;
+        }
+        std::optional<uint64_t> hash_of(const std::string& file, DiskState& state) {
+            if (!state.hash) {
+                std::string text{};
+                if (read_file(file, text) != 0)
+                    return std::nullopt;
+                state.hash = hash(text);
+            }
+            return state.hash;
+        }
+
+        void load() {
+            std::string text{};
+            if (read_file(path, text) != 0 || text.compare(0, header.size(), header) != 0)
+                return;
+            size_t begin = text.find('\n');
+            // a manifest written by a system with other rules or extensions says nothing about this one's outputs
+            if (begin == std::string::npos ||
+                std::strtoull(text.c_str() + header.size(), nullptr, 16) != fingerprint)
+                return;
+            Entry* entry = nullptr;
+            for (++begin; begin < text.size();) {
+                size_t end = text.find('\n', begin);
+                if (end == std::string::npos)
+                    end = text.size();
+                const std::string line = text.substr(begin, end - begin);
+                begin = end + 1;
+                if (line.compare(0, 6, "input ") == 0)
+                    entry = &entries[line.substr(6)];
+                else if (entry && line.compare(0, 7, "output ") == 0)
+                    entry->output = line.substr(7);
+                else if (entry && line.compare(0, 5, "file ") == 0) {
+                    // file <size> <mtime> <hash> <path>
+                    FileState file{};
+                    char* next = nullptr;
+                    file.size = std::strtoull(line.c_str() + 5, &next, 10);
+                    file.mtime = std::strtoll(next, &next, 10);
+                    file.hash = std::strtoull(next, &next, 16);
+                    if (*next != ' ') {
+                        entries.clear();
+                        return;
+                    }
+                    file.path = next + 1;
+                    entry->dependencies.emplace_back(std::move(file));
+                }
+            }
+        }
+
+      public:
+        // loads the manifest at `path` if there is one that was written with the same `fingerprint`
+        BuildManifest(std::string path, const uint64_t fingerprint) : path{std::move(path)}, fingerprint{fingerprint} {
+            load();
+        }
+        BuildManifest(const BuildManifest&) = delete;
+        BuildManifest& operator=(const BuildManifest&) = delete;
+
+        static uint64_t hash(const std::string& data) { return System::Grammar::checksum(data.data(), data.size()); }
+
+        // true if `output` exists and was made from `input` with none of its dependencies changed since
+        bool is_up_to_date(const std::string& input, const std::string& output) {
+            std::lock_guard lock{mutex};
+            const auto it = entries.find(input);
+            if (it == entries.end() || it->second.output != output || !look_at(output).exists)
+                return false;
+            for (auto& file : it->second.dependencies) {
+                auto& state = look_at(file.path);
+                if (!state.exists || state.size != file.size)
+                    return false;
+                if (state.mtime == file.mtime)
+                    continue;
+                if (hash_of(file.path, state) != file.hash)
+                    return false;
+                // only touched, it isn't hashed again next time
+                file.mtime = state.mtime;
+            }
+            return true;
+        }
+
+        // records that `output` was made from `input` (as it was when it was read) and `dependencies`, which are looked
+        // at now
+        void record(const std::string& input, const std::string& output, const FileState& input_state,
+                    const std::vector<std::string>& dependencies) {
+            std::lock_guard lock{mutex};
+            Entry entry{output, {input_state}};
+            for (const auto& file : dependencies) {
+                auto& state = look_at(file);
+                const auto hash = state.exists ? hash_of(file, state) : std::nullopt;
+                // without a hash to compare to, the output is made again next time
+                if (!hash) {
+                    entries.erase(input);
+                    return;
+                }
+                entry.dependencies.emplace_back(FileState{file, state.size, state.mtime, *hash});
+            }
+            entries[input] = std::move(entry);
+        }
+        // forgets `input`, its output is made again next time
+        void forget(const std::string& input) {
+            std::lock_guard lock{mutex};
+            entries.erase(input);
+        }
+
+        // writes the manifest, replacing the old one atomically, returns 0 or errno
+        int save() {
+            std::lock_guard lock{mutex};
+            std::vector<const std::pair<const std::string, Entry>*> sorted{};
+            for (const auto& entry : entries) sorted.emplace_back(&entry);
+            std::sort(sorted.begin(), sorted.end(), [](const auto* a, const auto* b) { return a->first < b->first; });
+
+            char number[32]{};
+            std::snprintf(number, sizeof(number), "%016llx", static_cast<unsigned long long>(fingerprint));
+            std::string text = std::string{header} + number + '\n';
+            // paths with new lines can't be written, those outputs are made again next time
+            const auto has_new_line = [](const std::string& path) { return path.find('\n') != std::string::npos; };
+            for (const auto* entry : sorted) {
+                bool valid = !has_new_line(entry->first) && !has_new_line(entry->second.output);
+                for (const auto& file : entry->second.dependencies) valid = valid && !has_new_line(file.path);
+                if (!valid)
+                    continue;
+                text += "input " + entry->first + "\noutput " + entry->second.output + '\n';
+                for (const auto& file : entry->second.dependencies) {
+                    std::snprintf(number, sizeof(number), "%016llx", static_cast<unsigned long long>(file.hash));
+                    text += "file " + std::to_string(file.size) + ' ' + std::to_string(file.mtime) + ' ' + number + ' ' +
+                            file.path + '\n';
+                }
+            }
+            return replace_file(path, text);
+        }
+    };
+} // namespace mgm
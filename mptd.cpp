@@ -0,0 +1,113 @@
+#include <csignal>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "mpt.hpp"
+#include "mpt_io.hpp"
+#include "shader_grammar.hpp"
+
+
+// mptd keeps a compiled grammar warm and parses requests sent to a Unix socket, so tools don't have to build their
+// System on every run
+// every message is a frame (see `mgm::write_frame`), a request is a 'P' frame holding the input, and the reply is
+// an 'O' frame with the output, or an 'E' frame with one error per line (`line:column: message`)
+// a connection can send any number of requests, each one is parsed with fresh extension state, as if by a new process
+
+namespace {
+    int listen_fd = -1;
+    std::string socket_path{};
+
+    void stop(int) {
+        ::close(listen_fd);
+        ::unlink(socket_path.c_str());
+        std::_Exit(0);
+    }
+
+    std::string format_errors(const std::vector<mgm::System::CompilationError>& errors) {
+        std::string res{};
+        for (const auto& err : errors)
+            res += std::to_string(err.pos.line) + ':' + std::to_string(err.pos.column) + ": " + err.message + '\n';
+        return res;
+    }
+
+    void serve(const int fd, const mgm::System handle) {
+        char type = 0;
+        std::string request{};
+        while (mgm::read_frame(fd, type, request) == 0) {
+            int error = 0;
+            if (type != 'P')
+                error = mgm::write_frame(fd, 'E', "unknown request type\n");
+            else {
+                // a copy of the untouched handle starts without extension state
+                auto system = handle;
+                const auto res = system.parse(std::move(request));
+                error = res.is_error() ? mgm::write_frame(fd, 'E', format_errors(res.error()))
+                                       : mgm::write_frame(fd, 'O', res.result());
+            }
+            if (error != 0)
+                break;
+            request = {};
+        }
+        ::close(fd);
+    }
+} // namespace
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << "usage: " << argv[0] << " <socket path> [rule file]" << std::endl;
+        return 1;
+    }
+    socket_path = argv[1];
+
+    // the example shader grammar, or the rules of the rule file with its extensions
+    mgm::System mp{};
+    if (argc < 3)
+        add_shader_grammar(mp);
+    else {
+        add_shader_extensions(mp);
+        const auto loaded = mgm::load_grammar_file(mp, argv[2]);
+        if (loaded.is_error()) {
+            for (const auto& err : loaded.error())
+                std::cerr << argv[2] << ':' << err.pos.line << ": " << err.message << std::endl;
+            return 1;
+        }
+    }
+    mp.compile();
+    // files included with $INCLUDE are mapped, and read and parsed once for all connections
+    mp.set_include_cache(std::make_shared<mgm::System::IncludeCache>(std::make_shared<mgm::MappedFileReader>()));
+
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "socket path too long: " << socket_path << std::endl;
+        return 1;
+    }
+    socket_path.copy(addr.sun_path, socket_path.size());
+
+    listen_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    ::unlink(socket_path.c_str());
+    if (listen_fd < 0 || ::bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+        ::listen(listen_fd, SOMAXCONN) != 0) {
+        std::cerr << "can't listen on " << socket_path << ": " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+    std::signal(SIGINT, stop);
+    std::signal(SIGTERM, stop);
+    std::signal(SIGPIPE, SIG_IGN);
+
+    while (true) {
+        const int fd = ::accept(listen_fd, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            std::cerr << "accept failed: " << std::strerror(errno) << std::endl;
+            return 1;
+        }
+        // handles are made on this thread, then each connection parses on its own thread
+        std::thread{serve, fd, mp.handle()}.detach();
+    }
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include <string>
+
+#include "mpt.hpp"
+
+
+struct ShaderExtension : public mgm::System::Extension {
+    virtual mgm::System::Result<std::string> operator()(mgm::System& system, const mgm::System::GenericValueMap& found_words,
+                                                        const std::string&) override {
+        std::string res = "#version 450 core\n";
+        for (const auto& word : found_words.at("var")) {
+            const auto parsed_word = system.parse(word, true);
+            if (parsed_word.is_error()) {
+                // for (const auto& err : parsed_word.error())
+                //     std::cerr << "Error at " << err.pos.line << ':' << err.pos.column << "\n\t" << err.message << std::endl;
+                return mgm::System::Error{static_cast<int64_t>(parsed_word.error()[0].code), parsed_word.error()[0].message};
+            }
+            res += parsed_word.result() + '\n';
+        }
+        return res;
+    }
+
+    // keeps no state, extensions called by the parses it starts (like EXPAND_COUNT) are counted on their own
+    bool is_pure() const override { return true; }
+};
+
+// the extensions used by the example shader grammar, for rules loaded from test.mpt
+inline void add_shader_extensions(mgm::System& mp) {
+    mp.enable_default_extensions();
+    mp.add_extension<ShaderExtension>("SHADER");
+}
+
+// the example shader grammar (see test.mmd), shared by the demo and the tools
+inline void add_shader_grammar(mgm::System& mp) {
+    add_shader_extensions(mp);
+
+    mp.rules.emplace_back("^  vertex", "^  fragment", "   {", "   vars:", " *$var", " * ;", "   code:", " *$code", " * ;",
+                          "   }", "  +\"$SHADER\nvoid main() {\n$($code;\n)}\"");
+    mp.rules.emplace_back("   var", "  $type", "  $name", "  +\"uniform $type $name;\"");
+    mp.rules.emplace_back("   buffer", "  $type", "  $name",
+                          "  +\"layout(std140, location = $EXPAND_COUNT(LayoutLocation)) buffer $name { $type $name[]; };\"");
+}
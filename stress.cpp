@@ -0,0 +1,116 @@
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+
+#include "mpt.hpp"
+
+
+// parses the same input on many handles at once while another thread keeps publishing new grammars to the `LiveGrammar`
+// they follow, and a third one keeps replacing an included file (with the same text) and clearing the `IncludeCache`
+// all the handles share
+// every parse has to give the output of exactly one of the published grammars, build with MPT_SANITIZE_THREAD to also
+// check for data races
+
+// a system with `kw<i>_ $value ;` rules that expand to `<tag>$value;`, and `use $path ;` to include a file
+void add_rules(mgm::System& mp, const std::string& tag, const std::string& include_directory) {
+    mp.enable_default_extensions();
+    mp.include_directory = include_directory;
+    for (size_t i = 0; i < 20; i++) {
+        const auto kw = "kw" + std::to_string(i) + "_";
+        mp.rules.emplace_back("   " + kw, "  $value", "   ;", "  +\"" + tag + "$value;\"");
+    }
+    mp.rules.emplace_back("   use", "  $path", "   ;", "  +\"$INCLUDE($path)\"");
+}
+
+// replaces `path` atomically, so readers see either the old or the new file
+void write_file(const std::filesystem::path& path, const std::string& text) {
+    const auto temp = path.string() + ".tmp";
+    std::ofstream{temp, std::ios::binary} << text;
+    std::filesystem::rename(temp, path);
+}
+
+int main(int argc, char** argv) {
+    const size_t num_threads = argc > 1 ? std::stoul(argv[1]) : 8;
+    const size_t num_parses = argc > 2 ? std::stoul(argv[2]) : 200;
+
+    const auto directory = std::filesystem::temp_directory_path() / ("mpt-stress-" + std::to_string(std::random_device{}()));
+    std::filesystem::create_directories(directory);
+    write_file(directory / "a.mmd", "kw1_ a ;\nuse \"b.mmd\" ;\n");
+    const std::string b_text = "kw2_ b ;\nkw3_ c ;\n";
+    write_file(directory / "b.mmd", b_text);
+
+    std::string input{};
+    for (size_t i = 0; i < 200; i++)
+        input += i % 10 == 0 ? "use \"a.mmd\" ;\n" : "kw" + std::to_string(i % 20) + "_ v" + std::to_string(i) + " ;\n";
+
+    // the output of each grammar, from systems that don't share anything with the ones below
+    mgm::System versions[2]{};
+    std::string expected[2]{};
+    for (size_t v = 0; v < 2; v++) {
+        add_rules(versions[v], v == 0 ? "A" : "B", directory.string());
+        const auto res = versions[v].parse(input);
+        if (res.is_error()) {
+            std::cerr << "Error at " << res.error()[0].pos.line << ':' << res.error()[0].pos.column << "\n\t"
+                      << res.error()[0].message << std::endl;
+            return 1;
+        }
+        expected[v] = res.result();
+    }
+
+    mgm::System mp{};
+    add_rules(mp, "A", directory.string());
+    mp.set_executor(std::make_shared<mgm::System::ThreadPool>(3));
+    auto live = std::make_shared<mgm::System::LiveGrammar>(mp.compiled());
+    std::vector<mgm::System> handles{};
+    for (size_t i = 0; i < num_threads; i++) {
+        handles.emplace_back(mp.handle());
+        handles.back().follow(live);
+    }
+
+    std::atomic<size_t> mismatches{0}, parses{0};
+    std::atomic<bool> done{false};
+    std::vector<std::thread> threads{};
+    for (size_t t = 0; t < num_threads; t++)
+        threads.emplace_back([&, t]() {
+            auto& handle = handles[t];
+            for (size_t i = 0; i < num_parses; i++) {
+                // some of the parses split the input over the shared executor
+                const auto res = i % 4 == 3 ? handle.parse_parallel(input, false, 512) : handle.parse(input);
+                if (res.is_error() || (res.result() != expected[0] && res.result() != expected[1]))
+                    ++mismatches;
+                ++parses;
+            }
+        });
+
+    size_t published = 0;
+    std::thread publisher{[&]() {
+        for (size_t v = 1; !done.load(); v++, published++) {
+            live->publish(versions[v % 2].compiled());
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+    }};
+    std::thread toucher{[&]() {
+        for (size_t i = 0; !done.load(); i++) {
+            write_file(directory / "b.mmd", b_text);
+            if (i % 8 == 0)
+                mp.get_include_cache().clear();
+            std::this_thread::sleep_for(std::chrono::microseconds(500));
+        }
+    }};
+
+    for (auto& thread : threads) thread.join();
+    done = true;
+    publisher.join();
+    toucher.join();
+    std::filesystem::remove_all(directory);
+
+    const auto& cache = mp.get_include_cache();
+    std::cout << parses << " parses on " << num_threads << " threads, " << published << " grammars published, "
+              << cache.num_reads << " include reads, " << mismatches << " mismatches" << std::endl;
+    return mismatches == 0 ? 0 : 1;
+}
@@ -5,6 +5,7 @@
 #endif
 
 #include "mpt.hpp"
+#include "shader_grammar.hpp"
 #include <fstream>
 
 std::string load_file(const std::string& file) {
@@ -17,35 +18,11 @@ std::string load_file(const std::string& file) {
     return str;
 }
 
-struct ShaderExtension : public mgm::System::Extension {
-    virtual mgm::System::Result<std::string> operator()(mgm::System& system, const mgm::System::GenericValueMap& found_words,
-                                                        const std::string&) override {
-        std::string res = "#version 450 core\n";
-        for (const auto& word : found_words.at("var")) {
-            const auto parsed_word = system.parse(word, true);
-            if (parsed_word.is_error()) {
-                // for (const auto& err : parsed_word.error())
-                //     std::cerr << "Error at " << err.pos.line << ':' << err.pos.column << "\n\t" << err.message << std::endl;
-                return mgm::System::Error{static_cast<int64_t>(parsed_word.error()[0].code), parsed_word.error()[0].message};
-            }
-            res += parsed_word.result() + '\n';
-        }
-        return res;
-    }
-};
-
 int main() {
     const auto test = load_file("test.mmd");
 
     mgm::System mp{};
-    mp.enable_default_extensions();
-
-    mp.add_extension<ShaderExtension>("SHADER");
-    mp.rules.emplace_back("^  vertex", "^  fragment", "   {", "   vars:", " *$var", " * ;", "   code:", " *$code", " * ;",
-                          "   }", "  +\"$SHADER\nvoid main() {\n$($code;\n)}\"");
-    mp.rules.emplace_back("   var", "  $type", "  $name", "  +\"uniform $type $name;\"");
-    mp.rules.emplace_back("   buffer", "  $type", "  $name",
-                          "  +\"layout(std140, location = $EXPAND_COUNT(LayoutLocation)) buffer $name { $type $name[]; };\"");
+    add_shader_grammar(mp);
 
     const auto bytecode = mp.parse(test);
     if (bytecode.is_error())
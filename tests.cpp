@@ -0,0 +1,260 @@
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "mpt.hpp"
+#include "mpt_io.hpp"
+#include "shader_grammar.hpp"
+
+
+// regression tests, each one is run on its own by name (see `add_test` in CMakeLists.txt)
+//   mpt_tests <test> [arguments...]
+// a test prints what went wrong and returns false
+
+namespace {
+    using Arguments = std::vector<std::string>;
+
+    // prints `message` if `ok` is false, and returns `ok`
+    bool check(const bool ok, const std::string& message) {
+        if (!ok)
+            std::cerr << message << std::endl;
+        return ok;
+    }
+
+    std::string describe(const std::vector<mgm::System::CompilationError>& errors) {
+        std::string text = std::to_string(errors.size()) + " errors:";
+        for (const auto& err : errors)
+            text += "\n\t" + std::to_string(err.pos.line) + ':' + std::to_string(err.pos.column) + ' ' + err.message;
+        return text;
+    }
+    std::string describe(const mgm::System::Result<std::string, std::vector<mgm::System::CompilationError>>& res) {
+        return res.is_error() ? describe(res.error()) : "output \"" + res.result() + '"';
+    }
+
+    // an expression that fails in an expansion ends the statement, what was expanded before it isn't parsed (it
+    // matched the same rule again, and recursed until the stack ran out)
+    bool expand_error(const Arguments&) {
+        mgm::System mp{};
+        mp.enable_default_extensions();
+        mp.rules.emplace_back("   call", "  $x", "  +call $x $nosuch");
+        const auto res = mp.parse(std::string{"call b\ncall c"});
+        return check(res.is_error() && res.error().size() == 2 && res.error()[0].pos.line == 1 &&
+                         res.error()[1].pos.line == 2 && res.error()[0].message.find("nosuch") != std::string::npos,
+                     "expected an error on each line, got " + describe(res));
+    }
+
+    // a plain fixed size pool that runs its tasks in the order they were submitted, and can't run them from
+    // `run_pending`, like a pool an application would already have
+    class FifoExecutor : public mgm::System::Executor {
+        std::mutex mutex{};
+        std::condition_variable changed{};
+        std::deque<std::function<void()>> tasks{};
+        std::vector<std::thread> threads{};
+        bool stop = false;
+
+      public:
+        FifoExecutor(const size_t num_threads) {
+            for (size_t i = 0; i < num_threads; i++)
+                threads.emplace_back([this]() {
+                    while (true) {
+                        std::function<void()> task{};
+                        {
+                            std::unique_lock lock{mutex};
+                            changed.wait(lock, [this]() { return stop || !tasks.empty(); });
+                            if (tasks.empty())
+                                return;
+                            task = std::move(tasks.front());
+                            tasks.pop_front();
+                        }
+                        task();
+                    }
+                });
+        }
+        void submit(std::function<void()> task) override {
+            {
+                std::lock_guard lock{mutex};
+                tasks.emplace_back(std::move(task));
+            }
+            changed.notify_one();
+        }
+        size_t concurrency() const override { return threads.size() + 1; }
+        ~FifoExecutor() override {
+            {
+                std::lock_guard lock{mutex};
+                stop = true;
+            }
+            changed.notify_all();
+            for (auto& thread : threads) thread.join();
+        }
+    };
+
+    // nested expansions large enough to be parsed as tasks, which start tasks of their own on the same executor
+    void add_nested_rules(mgm::System& mp) {
+        mp.enable_default_extensions();
+        std::string leaf{}, middle{}, top{};
+        for (size_t i = 0; i < 40; i++) leaf += "\"leaf" + std::to_string(i) + "\" ";
+        for (size_t i = 0; i < 60; i++) middle += "x1 ; ";
+        for (size_t i = 0; i < 8; i++) top += "x2 ; count ; ";
+        mp.rules.emplace_back("   x1", "   ;", "  +" + leaf);
+        mp.rules.emplace_back("   x2", "   ;", "  +" + middle);
+        mp.rules.emplace_back("   x3", "   ;", "  +" + top);
+        mp.rules.emplace_back("   count", "   ;", "  +\"$EXPAND_COUNT(n) \"");
+    }
+
+    // `parallel_expansions` on an executor without `run_pending`, where a task waiting for the tasks it started can't
+    // run them on its own thread (it used to wait for them forever)
+    bool external_executor(const Arguments&) {
+        std::string input{};
+        for (size_t i = 0; i < 3; i++) input += "x3 ;\n";
+        mgm::System serial{};
+        add_nested_rules(serial);
+        const auto expected = serial.parse(input);
+        if (!check(!expected.is_error(), "serial parse failed, " + describe(expected)))
+            return false;
+        for (const size_t num_threads : {1, 3}) {
+            mgm::System mp{};
+            add_nested_rules(mp);
+            mp.parallel_expansions = true;
+            mp.set_executor(std::make_shared<FifoExecutor>(num_threads));
+            const auto res = mp.parse(input);
+            if (!check(!res.is_error() && res.result() == expected.result(),
+                       "output on " + std::to_string(num_threads) + " threads differs from the serial one"))
+                return false;
+        }
+        return true;
+    }
+
+    // the rules in `arguments[0]` saved as an image to `arguments[1]` and mapped back are the same grammar and give the
+    // same output, and images with a flipped bit (in the header or the tables) or cut short are rejected
+    bool grammar_image(const Arguments& arguments) {
+        if (!check(arguments.size() == 2, "usage: grammar_image <rule file> <image file>"))
+            return false;
+        const auto& rule_file = arguments[0];
+        const auto& image_file = arguments[1];
+        mgm::System mp{};
+        add_shader_extensions(mp);
+        const auto loaded = mgm::load_rules_file(mp, rule_file);
+        if (!check(!loaded.is_error(), "can't load " + rule_file))
+            return false;
+        const auto& grammar = mp.compile();
+        if (!check(mgm::save_grammar_image(grammar, image_file) == 0, "can't write " + image_file))
+            return false;
+
+        const auto image = mgm::load_grammar_image(image_file);
+        if (!check(!image.is_error() && *image.result() == grammar, "the mapped image doesn't match the compiled rules"))
+            return false;
+        mgm::System mapped{};
+        add_shader_extensions(mapped);
+        mapped.use_grammar(image.result());
+        const std::string input = "vertex {\n vars:\n var vec3 pos;\n buffer vec3 v;\n code:\n a;\n}\n";
+        const auto expected = mp.parse(input), res = mapped.parse(input);
+        if (!check(!expected.is_error() && !res.is_error() && res.result() == expected.result(),
+                   "the mapped image parses differently, " + describe(res) + " instead of " + describe(expected)))
+            return false;
+
+        const auto bytes = grammar.to_image();
+        const auto rejects = [&](const std::string& data, const std::string& what) {
+            return check(mgm::replace_file(image_file, data) == 0 && mgm::load_grammar_image(image_file).is_error(),
+                         "an image with " + what + " was loaded");
+        };
+        using Header = mgm::System::Grammar::ImageHeader;
+        bool ok = true;
+        // every bit of the header, but the checksum itself (which only has to differ from the real one)
+        for (size_t bit = 0; bit < sizeof(Header) * 8; bit++) {
+            auto data = bytes;
+            data[bit / 8] = static_cast<char>(data[bit / 8] ^ (1 << (bit % 8)));
+            ok = rejects(data, "header bit " + std::to_string(bit) + " flipped") && ok;
+        }
+        for (const size_t at : {sizeof(Header), (sizeof(Header) + bytes.size()) / 2, bytes.size() - 1}) {
+            auto data = bytes;
+            data[at] = static_cast<char>(data[at] ^ 1);
+            ok = rejects(data, "byte " + std::to_string(at) + " flipped") && ok;
+        }
+        for (const size_t size : {size_t{8}, sizeof(Header), bytes.size() / 2, bytes.size() - 1})
+            ok = rejects(bytes.substr(0, size), "only " + std::to_string(size) + " bytes") && ok;
+        return ok;
+    }
+
+    // the example shader grammar loaded from `arguments[0]` (test.mpt) is the one `add_shader_grammar` adds, and parses
+    // `arguments[1]` (test.mmd) the same way
+    bool rule_file(const Arguments& arguments) {
+        if (!check(arguments.size() == 2, "usage: rule_file <rule file> <input file>"))
+            return false;
+        mgm::System loaded{};
+        add_shader_extensions(loaded);
+        const auto res = mgm::load_rules_file(loaded, arguments[0]);
+        if (!check(!res.is_error() && res.result() == 3, "expected 3 rules from " + arguments[0]))
+            return false;
+        mgm::System expected{};
+        add_shader_grammar(expected);
+        if (!check(loaded.compile() == expected.compile(),
+                   arguments[0] + " doesn't compile to the grammar of add_shader_grammar"))
+            return false;
+
+        std::string input{};
+        if (!check(mgm::read_file(arguments[1], input) == 0, "can't read " + arguments[1]))
+            return false;
+        const auto output = loaded.parse(input), expected_output = expected.parse(input);
+        return check(!output.is_error() && !expected_output.is_error() && output.result() == expected_output.result(),
+                     "the loaded rules give " + describe(output) + " instead of " + describe(expected_output));
+    }
+
+    // escapes and comments, and the errors of a malformed rule file with the lines they are on, after which no rule is
+    // added at all
+    bool rule_file_errors(const Arguments&) {
+        mgm::System mp{};
+        const auto escaped = mp.load_rules("# a comment before the first rule\r\n"
+                                           "   tab\n"
+                                           "# a comment in a rule\n"
+                                           "  +\"a\\tb\\nc\\\\d\\\"e\"\n");
+        if (!check(!escaped.is_error() && escaped.result() == 1 && mp.rules.size() == 1 &&
+                       mp.rules[0].words.size() == 2 && mp.rules[0].words[1].word == "  +\"a\tb\nc\\d\\\"e\"",
+                   "escapes or comments were read wrong"))
+            return false;
+
+        const auto malformed = mp.load_rules("   good\n"       // 1
+                                             "  +\"fine\"\n"   // 2
+                                             "\n"              // 3
+                                             "   a\n"          // 4
+                                             "x? b\n"          // 5: not a prefix
+                                             "  +\"x\"\n"      // 6
+                                             "\n"              // 7
+                                             "# comment\n"     // 8
+                                             "   c\n"          // 9
+                                             "  +\n"           // 10: no text
+                                             "\n"              // 11
+                                             "   lonely\n"     // 12: rule without an expand word
+                                             "   words\n");    // 13
+        if (!check(malformed.is_error(), "a malformed rule file was loaded"))
+            return false;
+        std::vector<size_t> lines{};
+        for (const auto& err : malformed.error()) lines.emplace_back(err.pos.line);
+        bool ok = check(lines == std::vector<size_t>{5, 10, 12},
+                        "expected errors on lines 5, 10 and 12, got " + describe(malformed.error()));
+        ok = check(mp.rules.size() == 1, "rules were added from a file with errors") && ok;
+        return ok;
+    }
+} // namespace
+
+int main(int argc, char** argv) {
+    const std::map<std::string, std::function<bool(const Arguments&)>> tests{
+        {"expand_error", expand_error},
+        {"external_executor", external_executor},
+        {"grammar_image", grammar_image},
+        {"rule_file", rule_file},
+        {"rule_file_errors", rule_file_errors},
+    };
+    const auto test = argc > 1 ? tests.find(argv[1]) : tests.end();
+    if (test == tests.end()) {
+        std::cerr << "usage: " << argv[0] << " <test> [arguments...], tests:";
+        for (const auto& [name, run] : tests) std::cerr << ' ' << name;
+        std::cerr << std::endl;
+        return 1;
+    }
+    return test->second(Arguments(argv + 2, argv + argc)) ? 0 : 1;
+}